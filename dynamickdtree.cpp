@@ -0,0 +1,205 @@
+/**
+ * @file dynamickdtree.cpp
+ * Implementation of DynamicKDTree class.
+ */
+
+/**
+ * The constructor for DynamicKDTrees
+ * Builds a single tree out of 'newPoints', in the smallest slot it fits in
+ * @param newPoints  - the points to start with
+ * @param numThreads - the number of threads to build trees with
+ */
+template<int Dim>
+DynamicKDTree<Dim>::DynamicKDTree(const vector< Point<Dim> > & newPoints, int numThreads)
+    : numLive(newPoints.size()), buildThreads(numThreads)
+{
+    if (newPoints.empty())
+	return;
+
+    size_t slot = 0;
+    while ((size_t(1) << slot) < newPoints.size())
+	slot++;
+    trees.resize(slot + 1);
+    trees[slot].tree.reset(new KDTree<Dim>(newPoints, true, buildThreads));
+}
+
+/**
+ * insert
+ * Merges 'newPoint' with the full trees in slots 0, 1, 2, ... up to the first empty slot, and
+ * builds one tree of them there. A tree in slot i holds at most 2^i points, so the new tree fits.
+ * Dead copies in the merged trees are left out
+ * @param newPoint - the point to add
+ */
+template<int Dim>
+void DynamicKDTree<Dim>::insert(const Point<Dim> & newPoint)
+{
+    std::lock_guard<std::mutex> change(changeMutex);
+
+    /**
+     * only changes modify the trees and their dead copies, so while we hold 'changeMutex' they can
+     * be read without locking 'forestMutex', and searches carry on while the new tree is built
+     */
+    vector< Point<Dim> > merged(1, newPoint);
+    size_t slot = 0;
+    for (; slot < trees.size() && trees[slot].tree; slot++)
+	appendLive(trees[slot], merged);
+    std::unique_ptr< KDTree<Dim> > tree(new KDTree<Dim>(merged, true, buildThreads));
+
+    //swap the new tree in for the ones it replaces, and free those once searches can run again
+    vector<Slot> replaced(slot);
+    {
+	std::unique_lock<std::shared_timed_mutex> lock(forestMutex);
+	for (size_t i = 0; i < slot; i++)
+	    std::swap(replaced[i], trees[i]);
+	if (slot == trees.size())
+	    trees.push_back(Slot());
+	trees[slot].tree = std::move(tree);
+	numLive++;
+    }
+}
+
+/**
+ * erase
+ * Marks one live copy of 'oldPoint' dead in the first tree that has one. The copy is left in the
+ * tree, and searches skip it, until a quarter of that tree's copies are dead and it is compacted
+ * @param oldPoint - the point to remove
+ * @return whether 'oldPoint' was in the tree
+ */
+template<int Dim>
+bool DynamicKDTree<Dim>::erase(const Point<Dim> & oldPoint)
+{
+    std::lock_guard<std::mutex> change(changeMutex);
+
+    for (size_t i = 0; i < trees.size(); i++) {
+	Slot & slot = trees[i];
+	if (!slot.tree)
+	    continue;
+
+	//the copies of 'oldPoint' in this tree are the points at distance 0 from it
+	typename std::map< Point<Dim>, size_t >::const_iterator dead = slot.dead.find(oldPoint);
+	size_t numDead = dead == slot.dead.end() ? 0 : dead->second;
+	size_t numCopies = slot.tree->findWithinRadius(oldPoint, 0).size();
+	if (numCopies <= numDead)
+	    continue;
+
+	{
+	    std::unique_lock<std::shared_timed_mutex> lock(forestMutex);
+	    slot.dead[oldPoint]++;
+	    slot.numDead++;
+	    if (numDead + 1 == numCopies)
+		slot.gone.insert(oldPoint);
+	    numLive--;
+	}
+
+	if (slot.numDead * 4 >= slot.tree->getNodes().size())
+	    compact(i);
+	return true;
+    }
+    return false;
+}
+
+template<int Dim>
+size_t DynamicKDTree<Dim>::size() const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(forestMutex);
+    return numLive;
+}
+
+/**
+ * findNearestNeighbor
+ * Finds the closest live point in each tree, and picks the closest of those, breaking ties
+ * with Point::operator< just as KDTree::findNearestNeighbor does
+ * @param query - the point we want to find the closest one to
+ * @return the closest point in the tree to 'query'
+ */
+template<int Dim>
+Point<Dim> DynamicKDTree<Dim>::findNearestNeighbor(const Point<Dim> & query) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(forestMutex);
+
+    bool found = false;
+    Point<Dim> best;
+    double bestDistance = 0;
+    for (size_t t = 0; t < trees.size(); t++) {
+	Point<Dim> candidate;
+	if (!trees[t].tree || !nearestLive(trees[t], query, candidate))
+	    continue;
+
+	double distance = 0;
+	for (int d = 0; d < Dim; d++)
+	    distance += (query[d] - candidate[d]) * (query[d] - candidate[d]);
+	if (!found || distance < bestDistance || (distance == bestDistance && candidate < best)) {
+	    found = true;
+	    best = candidate;
+	    bestDistance = distance;
+	}
+    }
+    return best;
+}
+
+/**
+ * nearestLive
+ * Finds the closest point in the tree of 'slot' that is not dead. A point with a live copy
+ * left is still live, so only the points whose copies are all dead are skipped, and a tree
+ * without any of those is searched directly
+ * @param slot    - the tree to search, and its dead copies
+ * @param query   - the point we want to find the closest one to
+ * @param nearest - set to the closest live point, if there is one
+ * @return whether the tree has a live point
+ */
+template<int Dim>
+bool DynamicKDTree<Dim>::nearestLive(const Slot & slot, const Point<Dim> & query, Point<Dim> & nearest) const
+{
+    if (slot.gone.empty()) {
+	nearest = slot.tree->findNearestNeighbor(query);
+	return true;
+    }
+
+    return slot.tree->findNearestNeighbor(query, [&slot](const Point<Dim> & p) {
+	return slot.gone.count(p) != 0;
+    }, nearest);
+}
+
+/**
+ * appendLive
+ * Appends the points in the tree of 'slot' to 'live', leaving out as many copies of each point as
+ * are dead
+ * @param slot - the tree, and its dead copies
+ * @param live - the points to append to
+ */
+template<int Dim>
+void DynamicKDTree<Dim>::appendLive(const Slot & slot, vector< Point<Dim> > & live)
+{
+    std::map< Point<Dim>, size_t > skip(slot.dead);
+    const vector< Point<Dim> > & nodes = slot.tree->getNodes();
+    for (size_t i = 0; i < nodes.size(); i++) {
+	typename std::map< Point<Dim>, size_t >::iterator dead = skip.find(nodes[i]);
+	if (dead != skip.end() && dead->second > 0)
+	    dead->second--;
+	else
+	    live.push_back(nodes[i]);
+    }
+}
+
+/**
+ * compact
+ * Rebuilds the tree in slot 'i' from its live copies. It only gets smaller, so it stays in its slot.
+ * Called with 'changeMutex' held
+ * @param i - the slot to compact
+ */
+template<int Dim>
+void DynamicKDTree<Dim>::compact(size_t i)
+{
+    vector< Point<Dim> > live;
+    appendLive(trees[i], live);
+    std::unique_ptr< KDTree<Dim> > tree;
+    if (!live.empty())
+	tree.reset(new KDTree<Dim>(live, true, buildThreads));
+
+    Slot replaced;
+    {
+	std::unique_lock<std::shared_timed_mutex> lock(forestMutex);
+	std::swap(replaced, trees[i]);
+	trees[i].tree = std::move(tree);
+    }
+}
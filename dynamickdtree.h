@@ -0,0 +1,124 @@
+/**
+ * @file dynamickdtree.h
+ * A KDTree that points can be added to and removed from.
+ */
+
+#ifndef _DYNAMICKDTREE_H_
+#define _DYNAMICKDTREE_H_
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <vector>
+#include "kdtree.h"
+#include "point.h"
+
+/**
+ * DynamicKDTree class: a set of Points in Dim dimensional space that can be
+ * changed one point at a time while other threads search it.
+ *
+ * The points are kept in a forest of static KDTrees (Bentley and Saxe's
+ * logarithmic method): tree i holds at most 2^i points. Inserting a point
+ * merges it with trees 0, 1, 2, ... up to the first empty one, and builds
+ * a single tree in that slot, so each point is rebuilt into O(log n) trees
+ * over its lifetime. Erasing a point only marks one of its copies in one
+ * tree dead. Searches of a tree in which every copy of some point is dead
+ * skip those points as they reach them, and searches of any other tree
+ * take the usual fast path; once a quarter of a tree's copies are dead,
+ * that tree alone is rebuilt without them.
+ *
+ * Searches may run on any number of threads at once, alongside one
+ * thread changing the tree at a time. Changes build their new trees
+ * without blocking searches, and only stop them briefly to swap the new
+ * trees in.
+ */
+template<int Dim>
+class DynamicKDTree
+{
+    public:
+        /**
+         * Constructs a tree holding the given points.
+         * @param newPoints The points to start with, which may be empty.
+         * @param numThreads The number of threads to build trees with.
+         */
+        DynamicKDTree(const vector< Point<Dim> > & newPoints = vector< Point<Dim> >(), int numThreads = 1);
+
+        /**
+         * Adds a point. A point may be added more than once, and then
+         * stays in the tree until it has been erased as many times.
+         * @param newPoint The point to add.
+         */
+        void insert(const Point<Dim> & newPoint);
+
+        /**
+         * Removes one copy of a point.
+         * @param oldPoint The point to remove.
+         * @return Whether the point was in the tree.
+         */
+        bool erase(const Point<Dim> & oldPoint);
+
+        /**
+         * Gets the number of points in the tree, counting each copy.
+         * @return The number of points.
+         */
+        size_t size() const;
+
+        /**
+         * Finds the closest point to the parameter point in the tree. This
+         * gives the same point as KDTree::findNearestNeighbor() would on a
+         * KDTree built from the points currently in the tree, including
+         * how ties are broken.
+         * @param query The point we wish to find the closest neighbor to.
+         * @return The closest point to query, or Point<Dim>() if the tree
+         *  is empty.
+         */
+        Point<Dim> findNearestNeighbor(const Point<Dim> & query) const;
+
+    private:
+        /** Guards the forest and its dead copies: shared by searches, exclusive to swap in changes. */
+        mutable std::shared_timed_mutex forestMutex;
+
+        /** Lets only one change build new trees at a time. */
+        std::mutex changeMutex;
+
+        /** One tree of the forest, and which of its copies are dead. */
+        struct Slot
+        {
+            /** The tree, or NULL if the slot is empty. */
+            std::unique_ptr< KDTree<Dim> > tree;
+
+            /** How many copies of each point in the tree have been erased. */
+            std::map< Point<Dim>, size_t > dead;
+
+            /** The total of the counts in 'dead'. */
+            size_t numDead;
+
+            /** The points in the tree whose copies are all dead, which searches skip. */
+            std::set< Point<Dim> > gone;
+
+            Slot() : numDead(0) {}
+        };
+
+        /** trees[i] holds at most 2^i points. */
+        vector<Slot> trees;
+
+        /** The number of points in the tree. */
+        size_t numLive;
+
+        /** The number of threads to build trees with. */
+        int buildThreads;
+
+        /* finds the closest point in 'slot' that is not dead */
+        bool nearestLive(const Slot & slot, const Point<Dim> & query, Point<Dim> & nearest) const;
+
+        /* appends the points of 'slot' that are not dead to 'live' */
+        static void appendLive(const Slot & slot, vector< Point<Dim> > & live);
+
+        /* rebuilds the tree in slot i without its dead copies */
+        void compact(size_t i);
+};
+
+#include "dynamickdtree.cpp"
+#endif
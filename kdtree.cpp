@@ -78,19 +78,25 @@ double KDTree<Dim>::distanceSquared(const Point<Dim> & a, const Point<Dim> & b)
 /**
  * The constructor for KDTrees
  * We utilize a quick select algorithm using multiple helper functions to partition the vector
- * and place the medians in the correct indices.
- * @param newPoints - the vector of points we will construct the kdtree from
+ * and place the medians in the correct indices. The selection moves indices into 'newPoints'
+ * rather than the Points themselves, next to a copy of each point's coordinate in the dimension
+ * being split so that comparisons rarely need to look at the Points, and each Point is only
+ * copied once, into its final place.
+ * @param newPoints   - the vector of points we will construct the kdtree from
+ * @param allowPacked - whether the packed storage mode may be used
+ * @param numThreads  - the number of threads to build the tree with
  */
 template<int Dim>
-KDTree<Dim>::KDTree(const vector< Point<Dim> > & newPoints)
+KDTree<Dim>::KDTree(const vector< Point<Dim> > & newPoints, bool allowPacked, int numThreads)
 {
     //check for empty 'newPoints' vector
     if (newPoints.size() == 0)
 	return;
 
-    //copy 'newPoints' into the tree's member vector so we can edit it
-    for (size_t i = 0; i < newPoints.size(); i++)
-	points.push_back(newPoints[i]);
+    //the index in 'newPoints' of the point that will end up in each node
+    vector<BuildNode> order(newPoints.size());
+    for (size_t i = 0; i < order.size(); i++)
+	order[i].index = i;
 
     //variables that will be passed into the partition function
     int lo = 0;
@@ -98,19 +104,74 @@ KDTree<Dim>::KDTree(const vector< Point<Dim> > & newPoints)
     int piv = (lo + hi) / 2;
 
     //call the recursive helper function 'construct' to begin construction of the tree
-    construct(points, lo, hi, piv, 0);
+    if (numThreads > 1)
+	constructParallel(newPoints, order, numThreads);
+    else
+	construct(newPoints, order, lo, hi, piv, 0);
+
+    //copy the points into the tree's member vector in their final order
+    points.reserve(order.size());
+    for (size_t i = 0; i < order.size(); i++)
+	points.push_back(newPoints[order[i].index]);
+
+    //keep a packed copy of the finished tree if every coordinate fits in a byte
+    if (allowPacked)
+	pack();
+}
+
+/**
+ * fromNodes
+ * creates a tree that adopts an already built node array
+ * @param nodes       - the nodes, in the order 'getNodes' gives them
+ * @param allowPacked - whether the packed storage mode may be used
+ * @return the tree
+ */
+template<int Dim>
+KDTree<Dim> KDTree<Dim>::fromNodes(const vector< Point<Dim> > & nodes, bool allowPacked)
+{
+    KDTree<Dim> tree;
+    tree.points = nodes;
+    if (allowPacked && !nodes.empty())
+	tree.pack();
+    return tree;
+}
+
+template<int Dim>
+const vector< Point<Dim> > & KDTree<Dim>::getNodes() const
+{
+    return points;
+}
+
+/**
+ * pack
+ * fills 'packedPoints' with a byte-per-coordinate copy of 'points', or
+ * leaves it empty if some coordinate is not an integer in [0, 255] or some
+ * point is a mine, since packed searches never read a Point and would step
+ * over its mine without noticing
+ */
+template<int Dim>
+void KDTree<Dim>::pack()
+{
+    packedPoints.resize(points.size() * packedStride, 0);
+    for (size_t i = 0; i < points.size(); i++) {
+	if (points[i].is_mine() || !packPoint(points[i], &packedPoints[i * packedStride])) {
+	    packedPoints.clear();
+	    return;
+	}
+    }
 }
 
 /** 
  * The recursive helper function for use in the constructor
- * @param list - 	the list of points that we will be partitioning
- * @param low  - 	the lower index
- * @param high - 	the upper index
- * @param n    -	the index of the root (median)
- * @param dim  -	the current dimension we are working with 
+ * @param list  - 	the points the tree is being built from
+ * @param order - 	indices into 'list' that we will be partitioning
+ * @param low   - 	the lower index
+ * @param high  - 	the upper index
+ * @param n     -	the index of the root (median)
+ * @param dim   -	the current dimension we are working with 
  */
 template<int Dim>
-void KDTree<Dim>::construct(vector< Point<Dim> > & list, int low, int high, int n, int dim) {
+void KDTree<Dim>::construct(const vector< Point<Dim> > & list, vector<BuildNode> & order, int low, int high, int n, int dim) {
     /**
      * BASE CASE:
      * If the lower index is greater than or equal to the higher index, we know that there are no more
@@ -119,80 +180,248 @@ void KDTree<Dim>::construct(vector< Point<Dim> > & list, int low, int high, int
     if (low >= high)
 	return;
 	
-    //call the 'select' helper function which will run the QuickSelect algorithm on 'list'
-    select(list, low, high, n, dim);
+    //call the 'select' helper function which will run the QuickSelect algorithm on 'order'
+    loadKeys(list, order, low, high, dim);
+    select(list, order, low, high, n);
 
     //recursive calls on the left and right sublists
-    construct(list, low, n - 1, (low + n - 1) / 2, (dim + 1) % Dim);
-    construct(list, n + 1, high, (n + 1 + high) / 2, (dim + 1) % Dim);
+    construct(list, order, low, n - 1, (low + n - 1) / 2, (dim + 1) % Dim);
+    construct(list, order, n + 1, high, (n + 1 + high) / 2, (dim + 1) % Dim);
 }
 
 /**
- * the helper function 'select' which will recursively partition the 'list' using the QuickSelect algorithm.
- * @param list - 	the list of points that we will be partitioning
- * @param low  - 	the lower index
- * @param high - 	the upper index
- * @param n    -	the index of the root (median)
- * @param dim  -	the current dimension we are working with 
+ * constructParallel
+ * builds the same tree as 'construct' on several threads. The subtrees at each level of the
+ * tree cover disjoint ranges of 'order', so the medians of a whole level are selected at once,
+ * one subtree per task. Once subtrees are smaller than 'parallelBuildThreshold' they are each
+ * finished by 'construct' in a single task, so threads do not wait on each other per level
+ * @param list       - the points the tree is being built from
+ * @param order      - indices into 'list' that we will be partitioning
+ * @param numThreads - the number of threads to build with
  */
 template<int Dim>
-void KDTree<Dim>::select(vector< Point<Dim> > & list, int low, int high, int n, int dim) {
-    /**
-     * BASE CASE:
-     * If 'low' is equal to 'high' then we are done and have found the value we want
-     */
-    if (low == high)
-	return;
+void KDTree<Dim>::constructParallel(const vector< Point<Dim> > & list, vector<BuildNode> & order, int numThreads) {
+    //a subtree: the range [low, high] of 'order' and the dimension it splits on
+    struct Subtree {
+	int low;
+	int high;
+	int dim;
+    };
+
+    vector<Subtree> level(1, Subtree{0, (int) order.size() - 1, 0});
+    vector<Subtree> small;
+    while (!level.empty()) {
+	//place the median of every subtree on this level
+	util::forEachChunk(level.size(), 1, numThreads, [&](size_t begin, size_t end) {
+	    for (size_t i = begin; i < end; i++) {
+		loadKeys(list, order, level[i].low, level[i].high, level[i].dim);
+		select(list, order, level[i].low, level[i].high, (level[i].low + level[i].high) / 2);
+	    }
+	});
+
+	//then split each of them into the subtrees on the next level
+	vector<Subtree> next;
+	for (size_t i = 0; i < level.size(); i++) {
+	    int n = (level[i].low + level[i].high) / 2;
+	    int dim = (level[i].dim + 1) % Dim;
+	    Subtree children[2] = { Subtree{level[i].low, n - 1, dim}, Subtree{n + 1, level[i].high, dim} };
+	    for (int c = 0; c < 2; c++) {
+		int size = children[c].high - children[c].low + 1;
+		if (size > parallelBuildThreshold)
+		    next.push_back(children[c]);
+		else if (size > 1)
+		    small.push_back(children[c]);
+	    }
+	}
+	level.swap(next);
+    }
 
-    //partition the list around 'n'
-    int pivotIndex = partition(list, low, high, n, dim);
+    //finish the small subtrees, each on one thread
+    util::forEachChunk(small.size(), 1, numThreads, [&](size_t begin, size_t end) {
+	for (size_t i = begin; i < end; i++)
+	    construct(list, order, small[i].low, small[i].high, (small[i].low + small[i].high) / 2, small[i].dim);
+    });
+}
 
-    //the recursive calls where we determine if we have finished partitioning/selecting
-    if (n == pivotIndex)
-	return;
-    else if (n < pivotIndex)
-	select(list, low, pivotIndex - 1, n, dim);
-    else
-	select(list, pivotIndex + 1, high, n, dim);
+/**
+ * loadKeys
+ * copies the coordinate in 'dim' of each point in a range of 'order' next to its index
+ * @param list  - 	the points the tree is being built from
+ * @param order - 	indices into 'list'
+ * @param low   - 	the lower index
+ * @param high  - 	the upper index
+ * @param dim   -	the dimension the range will be split in
+ */
+template<int Dim>
+void KDTree<Dim>::loadKeys(const vector< Point<Dim> > & list, vector<BuildNode> & order, int low, int high, int dim) {
+    for (int i = low; i <= high; i++)
+	order[i].key = list[order[i].index][dim];
+}
+
+/**
+ * the helper function 'select' which will partition 'order' using the QuickSelect algorithm until
+ * the node at 'n' is the one that belongs there. The keys of the range must already hold the
+ * coordinates in the dimension being split.
+ *
+ * Pivots are usually the median of a few samples (a ninther for larger ranges), which is fast
+ * on any order of input. If two of those pivots in a row fail to halve the range, the input is
+ * defeating the samples, and the median of medians of five is used for the rest of the selection
+ * instead. That always shrinks the range by a constant fraction, so selection stays linear in the
+ * worst case (an introselect). Nodes equal to the pivot are gathered around it by 'partition', so
+ * ranges full of duplicates are finished in one step instead of one at a time.
+ * @param list  - 	the points the tree is being built from
+ * @param order - 	indices into 'list' that we will be partitioning
+ * @param low   - 	the lower index
+ * @param high  - 	the upper index
+ * @param n     -	the index of the root (median)
+ */
+template<int Dim>
+void KDTree<Dim>::select(const vector< Point<Dim> > & list, vector<BuildNode> & order, int low, int high, int n) {
+    //the size the range had two sampled pivots ago
+    int checkedSize = high - low + 1;
+    int passes = 0;
+    bool sampling = true;
+
+    while (low < high) {
+	int pivotIndex = sampling ? samplePivot(list, order, low, high) : medianOfMedians(list, order, low, high);
+
+	//partition the list around the pivot, and stop if 'n' is among the nodes equal to it
+	int equalHigh;
+	int equalLow = partition(list, order, low, high, pivotIndex, equalHigh);
+	if (n < equalLow)
+	    high = equalLow - 1;
+	else if (n > equalHigh)
+	    low = equalHigh + 1;
+	else
+	    return;
+
+	//stop sampling for good once two pivots leave more than half of the range
+	if (sampling && ++passes == 2) {
+	    int size = high - low + 1;
+	    sampling = size <= checkedSize / 2;
+	    checkedSize = size;
+	    passes = 0;
+	}
+    }
+}
+
+/**
+ * compareNodes
+ * smallerDimVal on nodes whose keys are loaded, only looking at the Points to break ties
+ * @param list   - the points the tree is being built from
+ * @param first  - a node
+ * @param second - another node
+ * @return a negative number if 'first' is smaller, a positive one if 'second' is, or 0 if they are equal
+ */
+template<int Dim>
+int KDTree<Dim>::compareNodes(const vector< Point<Dim> > & list, const BuildNode & first, const BuildNode & second) {
+    if (first.key != second.key)
+	return first.key < second.key ? -1 : 1;
+    if (list[first.index] < list[second.index])
+	return -1;
+    if (list[second.index] < list[first.index])
+	return 1;
+    return 0;
+}
+
+/**
+ * medianOfThree
+ * @return whichever of the indices 'a', 'b' and 'c' in 'order' holds the median of the three nodes
+ */
+template<int Dim>
+int KDTree<Dim>::medianOfThree(const vector< Point<Dim> > & list, const vector<BuildNode> & order, int a, int b, int c) {
+    if (compareNodes(list, order[a], order[b]) < 0) {
+	if (compareNodes(list, order[b], order[c]) < 0)
+	    return b;
+	return compareNodes(list, order[a], order[c]) < 0 ? c : a;
+    }
+    if (compareNodes(list, order[a], order[c]) < 0)
+	return a;
+    return compareNodes(list, order[b], order[c]) < 0 ? c : b;
+}
+
+/**
+ * samplePivot
+ * picks a pivot from a few samples of the range: the median of the first, middle and last nodes,
+ * or for larger ranges the median of three such medians (Tukey's ninther)
+ * @return the index in 'order' of the pivot
+ */
+template<int Dim>
+int KDTree<Dim>::samplePivot(const vector< Point<Dim> > & list, const vector<BuildNode> & order, int low, int high) {
+    int mid = low + (high - low) / 2;
+    if (high - low < 40)
+	return medianOfThree(list, order, low, mid, high);
+
+    int step = (high - low) / 8;
+    return medianOfThree(list, order,
+	    medianOfThree(list, order, low, low + step, low + 2 * step),
+	    medianOfThree(list, order, mid - step, mid, mid + step),
+	    medianOfThree(list, order, high - 2 * step, high - step, high));
+}
+
+/**
+ * medianOfMedians
+ * picks a pivot that is guaranteed to have a constant fraction of the range on either side of it:
+ * the median of the medians of each group of five nodes. The medians are moved to the front of
+ * the range and their median is found with 'select'
+ * @return the index in 'order' of the pivot
+ */
+template<int Dim>
+int KDTree<Dim>::medianOfMedians(const vector< Point<Dim> > & list, vector<BuildNode> & order, int low, int high) {
+    int numMedians = 0;
+    for (int group = low; group <= high; group += 5) {
+	int groupHigh = std::min(group + 4, high);
+
+	//insertion sort the group, and move its median to the front of the range
+	for (int i = group + 1; i <= groupHigh; i++)
+	    for (int j = i; j > group && compareNodes(list, order[j], order[j - 1]) < 0; j--)
+		std::swap(order[j], order[j - 1]);
+	std::swap(order[low + numMedians], order[group + (groupHigh - group) / 2]);
+	numMedians++;
+    }
+
+    int pivotIndex = low + (numMedians - 1) / 2;
+    select(list, order, low, low + numMedians - 1, pivotIndex);
+    return pivotIndex;
 }
 
 /**
  * partition
- * This is the helper function that will partition within the given indices in 'list'
- * @param list - 	the list of points that we will be partitioning
- * @param low  - 	the lower index
- * @param high - 	the upper index
+ * This is the helper function that will partition within the given indices in 'order' into the
+ * nodes smaller than the pivot, the nodes equal to it, and the nodes larger than it
+ * @param list  - 	the points the tree is being built from
+ * @param order - 	indices into 'list' that we will be partitioning
+ * @param low   - 	the lower index
+ * @param high  - 	the upper index
  * @param pivotIndex -  the index that we are partitioning around
- * @param dim  -	the current dimension we are working with 
- * @return the index that the element originally in 'pivotIndex' has ended up
+ * @param equalHigh  -  set to the last index of the nodes equal to the pivot
+ * @return the first index of the nodes equal to the pivot
  */
 template<int Dim>
-int KDTree<Dim>::partition(vector< Point<Dim> > & list, int low, int high, int pivotIndex, int dim) {
-    //get the Point<Dim> @ pivotIndex
-    Point<Dim> pivotValue = list[pivotIndex];
-	
-    //move pivotValue to the 'high' index, i.e. the end of the list
-    std::swap(list[pivotIndex], list[high]);
-
-    //declare 'storeIndex' which will be the next point to swap - initialized to 'low'
-    int storeIndex = low;
-
-    //partition the array
-    for (int i = low; i < high; i++) {
-	if (smallerDimVal(list[i], pivotValue, dim)) {
-	    //swap the elements in 'i' and 'storeIndex'
-	    std::swap(list[i], list[storeIndex]);
-	    
-	    //increment 'storeIndex' to the next element that will be swapped
-	    storeIndex++;
- 	}
-    }
+int KDTree<Dim>::partition(const vector< Point<Dim> > & list, vector<BuildNode> & order, int low, int high, int pivotIndex,
+	int & equalHigh) {
+    //get the node @ pivotIndex
+    BuildNode pivotValue = order[pivotIndex];
 
-    //final swap to move the pivot to the spot it belongs in
-    std::swap(list[high], list[storeIndex]);
+    /**
+     * [low, lessEnd) holds the nodes smaller than the pivot, [lessEnd, i) the ones equal to it,
+     * and (greaterStart, high] the larger ones. The nodes in [i, greaterStart] are still unsorted
+     */
+    int lessEnd = low;
+    int greaterStart = high;
+    int i = low;
+    while (i <= greaterStart) {
+	int cmp = compareNodes(list, order[i], pivotValue);
+	if (cmp < 0)
+	    std::swap(order[i++], order[lessEnd++]);
+	else if (cmp > 0)
+	    std::swap(order[i], order[greaterStart--]);
+	else
+	    i++;
+    }
 
-    //return the index of the pivot
-    return storeIndex;
+    equalHigh = greaterStart;
+    return lessEnd;
 }
 
 /**
@@ -204,67 +433,559 @@ int KDTree<Dim>::partition(vector< Point<Dim> > & list, int low, int high, int p
 template<int Dim>
 Point<Dim> KDTree<Dim>::findNearestNeighbor(const Point<Dim> & query) const
 {
+    //use the packed copy of the tree when both it and 'query' are byte-valued
+    uint8_t packedQuery[packedStride] = {0};
+    if (isPacked() && packPoint(query, packedQuery)) {
+	int bestDistance;
+	return points[packedNearestIndex(packedQuery, 0, points.size() - 1, 0, bestDistance)];
+    }
+
     //call the helper function that will return the index of the closest point to 'query'
     return points[nearestIndex(query, 0, points.size() - 1, 0)];
 }
 
+/**
+ * findNearestNeighbor
+ * Finds the nearest neighbor to 'query' that 'skip' does not reject. Always searches
+ * the Points, since the packed copy has no Points to hand to 'skip'
+ * @param query   - the point we want to find the closest one to
+ * @param skip    - whether a point should be passed over
+ * @param nearest - set to the closest point not skipped, if there is one
+ * @return whether there is a point that is not skipped
+ */
+template<int Dim>
+bool KDTree<Dim>::findNearestNeighbor(const Point<Dim> & query,
+	const std::function<bool(const Point<Dim> &)> & skip, Point<Dim> & nearest) const
+{
+    int index = nearestIndex(query, 0, points.size() - 1, 0, &skip);
+    if (index == -1)
+	return false;
+    nearest = points[index];
+    return true;
+}
+
+/**
+ * findNearestNeighbors
+ * Batched findNearestNeighbor: sorts the queries along a Morton curve and answers each
+ * distinct query once, in that order. Equal queries have equal keys, so repeats are
+ * found among the queries sharing a key before the work is split up.
+ * @param queries 	- the points we want to find the closest ones to
+ * @param numThreads 	- the number of threads to split the sorted queries across
+ * @return the closest point in the tree to each query, in the order of 'queries'
+ */
+template<int Dim>
+vector< Point<Dim> > KDTree<Dim>::findNearestNeighbors(const vector< Point<Dim> > & queries, int numThreads) const
+{
+    vector< Point<Dim> > results(queries.size());
+    if (queries.empty() || points.empty())
+	return results;
+
+    //find the bounding box of the queries so the Morton keys use their full range
+    double minVals[Dim];
+    double maxVals[Dim];
+    for (int d = 0; d < Dim; d++)
+	minVals[d] = maxVals[d] = queries[0][d];
+    for (size_t i = 1; i < queries.size(); i++) {
+	for (int d = 0; d < Dim; d++) {
+	    minVals[d] = std::min(minVals[d], queries[i][d]);
+	    maxVals[d] = std::max(maxVals[d], queries[i][d]);
+	}
+    }
+
+    //pair each query's Morton key with its index and sort along the curve
+    vector< std::pair<uint64_t, size_t> > order(queries.size());
+    for (size_t i = 0; i < queries.size(); i++)
+	order[i] = std::make_pair(mortonKey(queries[i], minVals, maxVals), i);
+    sortByMortonKey(order);
+
+    //list the distinct queries in curve order, and which of them each query is. Only
+    //queries in the same run of equal keys can repeat each other
+    vector<size_t> distinct;
+    vector<size_t> answer(queries.size());
+    for (size_t runStart = 0; runStart < order.size(); ) {
+	size_t runEnd = runStart + 1;
+	while (runEnd < order.size() && order[runEnd].first == order[runStart].first)
+	    runEnd++;
+
+	std::map< Point<Dim>, size_t > runQueries;
+	for (size_t i = runStart; i < runEnd; i++) {
+	    size_t index = order[i].second;
+	    std::pair<typename std::map< Point<Dim>, size_t >::iterator, bool> added(runQueries.end(), true);
+	    if (runEnd - runStart > 1)
+		added = runQueries.insert(std::make_pair(queries[index], distinct.size()));
+	    if (added.second) {
+		answer[index] = distinct.size();
+		distinct.push_back(index);
+	    } else
+		answer[index] = added.first->second;
+	}
+	runStart = runEnd;
+    }
+
+    //search for the distinct queries in sorted chunks, then hand each query its answer
+    vector< Point<Dim> > distinctResults(distinct.size());
+    util::forEachChunk(distinct.size(), 4096, numThreads, [&](size_t begin, size_t end) {
+	for (size_t i = begin; i < end; i++)
+	    distinctResults[i] = findNearestNeighbor(queries[distinct[i]]);
+    });
+    for (size_t i = 0; i < queries.size(); i++)
+	results[i] = distinctResults[answer[i]];
+
+    return results;
+}
+
+/**
+ * mortonKey
+ * Quantizes each coordinate of 'p' within [minVals, maxVals] and interleaves the bits
+ * so that points that are close together tend to have keys that are close together
+ * @param p 		- the point to compute the key of
+ * @param minVals 	- the smallest value in each dimension
+ * @param maxVals 	- the largest value in each dimension
+ * @return the Morton order key of 'p'
+ */
+template<int Dim>
+uint64_t KDTree<Dim>::mortonKey(const Point<Dim> & p, const double * minVals, const double * maxVals) {
+    const int bits = mortonBits;
+    const uint64_t maxCell = (uint64_t(1) << bits) - 1;
+
+    uint64_t cells[Dim];
+    for (int d = 0; d < Dim; d++) {
+	double range = maxVals[d] - minVals[d];
+	cells[d] = range > 0 ? static_cast<uint64_t>((p[d] - minVals[d]) / range * maxCell) : 0;
+    }
+
+    //interleave the bits, most significant first
+    uint64_t key = 0;
+    for (int b = bits - 1; b >= 0; b--)
+	for (int d = 0; d < Dim; d++)
+	    key = (key << 1) | ((cells[d] >> b) & 1);
+    return key;
+}
+
+/**
+ * sortByMortonKey
+ * Sorts (Morton key, index) pairs by key with a least significant digit radix sort,
+ * one byte of the key per pass, so pairs with equal keys stay in the order given
+ * @param order - the pairs to sort
+ */
+template<int Dim>
+void KDTree<Dim>::sortByMortonKey(vector< std::pair<uint64_t, size_t> > & order) {
+    vector< std::pair<uint64_t, size_t> > sorted(order.size());
+    for (int shift = 0; shift < mortonBits * Dim; shift += 8) {
+	//count each digit, then turn the counts into where each digit's pairs start
+	size_t starts[257] = {0};
+	for (size_t i = 0; i < order.size(); i++)
+	    starts[((order[i].first >> shift) & 0xff) + 1]++;
+	for (int digit = 0; digit < 256; digit++)
+	    starts[digit + 1] += starts[digit];
+
+	for (size_t i = 0; i < order.size(); i++)
+	    sorted[starts[(order[i].first >> shift) & 0xff]++] = order[i];
+	order.swap(sorted);
+    }
+}
+
+template<int Dim>
+bool KDTree<Dim>::isPacked() const
+{
+    return !packedPoints.empty();
+}
+
 /**
  * nearestIndex
- * the helper function for use in 'findNearestNeighbor' to conduct the NNS algorithm
+ * the helper function for use in 'findNearestNeighbor' to conduct the NNS algorithm.
+ * Rather than recursing, it walks down from the root toward 'query', checking each
+ * median on the way and pushing the subtree on the far side of its splitting plane
+ * onto an explicit stack, along with a lower bound on the distance from 'query' to
+ * anything in it. The bound is the distance to the subtree's cell: each splitting
+ * plane crossed on the way there replaces the offset along its dimension (Arya and
+ * Mount's incremental distance), and is summed in the same order as 'distanceSquared'
+ * so that it can never round above the distance to a point in the cell. Subtrees whose
+ * bound is larger than the best distance so far are skipped, and ties are still
+ * decided by Point::operator<, so the result is the same as searching every point
  * @param query - 	the point we want to find the closest point to
  * @param low   -	the lower index of the list of points we want to compare
  * @param high  - 	the upper index of the list of points we want to compare
  * @param dim   - 	the current splitting dimension we are working with
- * @return the index of the point closest to 'query'
+ * @param skip  - 	if not NULL, whether a point should be passed over rather than compared
+ * @return the index of the point closest to 'query', or -1 if the range is empty or
+ *         every point in it is skipped
  */
 template<int Dim>
-int KDTree<Dim>::nearestIndex(const Point<Dim> & query, int low, int high, int dim) const {
+int KDTree<Dim>::nearestIndex(const Point<Dim> & query, int low, int high, int dim,
+	const std::function<bool(const Point<Dim> &)> * skip) const {
+    if (low > high)
+	return -1;
+
     /**
-     * BASE CASE:
-     * If 'low' is greater than or equal to 'high' we know we are done searching
+     * a subtree still to be searched. The stack only ever holds subtrees at increasing
+     * depths, so it never needs more entries than the tree is deep
      */
+    struct Pending {
+	int low;
+	int high;
+	int dim;
+	double bound;
+	double offsets[Dim];
+    };
+    Pending stack[maxSearchDepth];
+    int top = 0;
+
+    stack[top].low = low;
+    stack[top].high = high;
+    stack[top].dim = dim;
+    stack[top].bound = 0;
+    for (int d = 0; d < Dim; d++)
+	stack[top].offsets[d] = 0;
+    top++;
+
+    int currentBest = -1;
+    double bestDistance = 0;
+    while (top > 0) {
+	Pending node = stack[--top];
+	if (currentBest != -1 && node.bound > bestDistance)
+	    continue;
+
+	while (node.low <= node.high) {
+	    int medianIndex = (node.low + node.high) / 2;
+	    const Point<Dim> & median = points[medianIndex];
+
+	    //compare the median against the best point so far, caching its distance
+	    if (skip == NULL || !(*skip)(median)) {
+		double distance = distanceSquared(query, median);
+		if (currentBest == -1 || distance < bestDistance
+			|| (distance == bestDistance && median < points[currentBest])) {
+		    currentBest = medianIndex;
+		    bestDistance = distance;
+		}
+	    }
+
+	    //keep going down the side containing 'query', and remember the other side
+	    bool searchLeft = smallerDimVal(query, median, node.dim);
+	    int nextDim = (node.dim + 1) % Dim;
+	    Pending far = node;
+	    far.dim = nextDim;
+	    far.offsets[node.dim] = query[node.dim] - median[node.dim];
+	    far.bound = 0;
+	    for (int d = 0; d < Dim; d++)
+		far.bound += far.offsets[d] * far.offsets[d];
+	    if (searchLeft) {
+		far.low = medianIndex + 1;
+		node.high = medianIndex - 1;
+	    } else {
+		far.high = medianIndex - 1;
+		node.low = medianIndex + 1;
+	    }
+	    node.dim = nextDim;
+
+	    if (far.low <= far.high && (currentBest == -1 || far.bound <= bestDistance))
+		stack[top++] = far;
+	}
+    }
+
+    return currentBest;
+}
+
+/**
+ * findKNearest
+ * Finds the 'k' points closest to 'query', keeping the best ones found so far in a
+ * max-heap whose top is the worst of them
+ * @param query - the point we want to find the closest points to
+ * @param k     - the number of points to find
+ * @return the min(k, size) closest points to 'query', closest first
+ */
+template<int Dim>
+vector< Point<Dim> > KDTree<Dim>::findKNearest(const Point<Dim> & query, int k) const
+{
+    if (k <= 0 || points.empty())
+	return vector< Point<Dim> >();
+
+    vector< std::pair<double, int> > best;
+    best.reserve(std::min<size_t>(k, points.size()) + 1);
+    kNearestIndices(query, 0, points.size() - 1, 0, k, best);
+
+    sortNeighbors(best);
+
+    vector< Point<Dim> > result(best.size());
+    for (size_t i = 0; i < best.size(); i++)
+	result[i] = points[best[i].second];
+    return result;
+}
+
+/**
+ * findWithinRadius
+ * Finds every point at most sqrt('radiusSquared') away from 'query'
+ * @param query 	- the point we want to find the neighbors of
+ * @param radiusSquared - the square of the largest distance to 'query' a point may be
+ * @return the points within range of 'query', closest first
+ */
+template<int Dim>
+vector< Point<Dim> > KDTree<Dim>::findWithinRadius(const Point<Dim> & query, double radiusSquared) const
+{
+    if (points.empty() || radiusSquared < 0)
+	return vector< Point<Dim> >();
+
+    vector< std::pair<double, int> > found;
+    withinRadiusIndices(query, 0, points.size() - 1, 0, radiusSquared, found);
+    sortNeighbors(found);
+
+    vector< Point<Dim> > result(found.size());
+    for (size_t i = 0; i < found.size(); i++)
+	result[i] = points[found[i].second];
+    return result;
+}
+
+/**
+ * closerNeighbor
+ * Orders neighbors by their distance to the query, breaking ties with Point::operator<
+ * @param first  - the squared distance and index of one neighbor
+ * @param second - the squared distance and index of another neighbor
+ * @return whether 'first' is closer than 'second'
+ */
+template<int Dim>
+bool KDTree<Dim>::closerNeighbor(const std::pair<double, int> & first, const std::pair<double, int> & second) const {
+    if (first.first != second.first)
+	return first.first < second.first;
+    return points[first.second] < points[second.second];
+}
+
+/**
+ * sortNeighbors
+ * Sorts neighbors closest first with a bottom-up merge sort, merging runs of width 1, 2,
+ * 4, ... back and forth between 'neighbors' and a buffer
+ * @param neighbors - the squared distances and indices of the neighbors to sort
+ */
+template<int Dim>
+void KDTree<Dim>::sortNeighbors(vector< std::pair<double, int> > & neighbors) const {
+    size_t size = neighbors.size();
+    vector< std::pair<double, int> > merged(size);
+    for (size_t width = 1; width < size; width *= 2) {
+	for (size_t low = 0; low < size; low += 2 * width) {
+	    size_t mid = std::min(low + width, size);
+	    size_t high = std::min(low + 2 * width, size);
+	    size_t left = low;
+	    size_t right = mid;
+	    for (size_t out = low; out < high; out++) {
+		//take from the right run only when it is strictly closer, so equal neighbors keep their order
+		if (left < mid && (right == high || !closerNeighbor(neighbors[right], neighbors[left])))
+		    merged[out] = neighbors[left++];
+		else
+		    merged[out] = neighbors[right++];
+	    }
+	}
+	neighbors.swap(merged);
+    }
+}
+
+/**
+ * kNearestIndices
+ * the helper function for 'findKNearest'. Searches like 'nearestIndex', but keeps the
+ * 'k' best neighbors in 'best', a max-heap ordered by 'closerNeighbor'
+ * @param query - 	the point we want to find the closest points to
+ * @param low   -	the lower index of the list of points we want to compare
+ * @param high  - 	the upper index of the list of points we want to compare
+ * @param dim   - 	the current splitting dimension we are working with
+ * @param k     - 	the number of neighbors to keep
+ * @param best  - 	the best neighbors found so far
+ */
+template<int Dim>
+void KDTree<Dim>::kNearestIndices(const Point<Dim> & query, int low, int high, int dim, size_t k,
+	vector< std::pair<double, int> > & best) const {
     if (low > high)
-	return low;
+	return;
 
-    //index to return
-    int currentBest;
+    auto worse = [this](const std::pair<double, int> & a, const std::pair<double, int> & b) {
+	return closerNeighbor(a, b);
+    };
 
-    //the current median's index based on the 'low' and 'high' range
     int medianIndex = (low + high) / 2;
 
-    /**
-     * Here we decide which subtree to traverse based on a comparison of the 
-     * values of the current splitting dimension of the point @ medianIndex and query
-     */
-    if (smallerDimVal(query, points[medianIndex], dim))
-	currentBest = nearestIndex(query, low, medianIndex - 1, (dim + 1) % Dim);
+    //descend into the subtree containing 'query' first
+    bool searchedLeft = smallerDimVal(query, points[medianIndex], dim);
+    if (searchedLeft)
+	kNearestIndices(query, low, medianIndex - 1, (dim + 1) % Dim, k, best);
     else
-	currentBest = nearestIndex(query, medianIndex + 1, high, (dim + 1) % Dim);
+	kNearestIndices(query, medianIndex + 1, high, (dim + 1) % Dim, k, best);
+
+    //then offer the median on the way back up, dropping the worst neighbor if there are too many
+    std::pair<double, int> median(distanceSquared(query, points[medianIndex]), medianIndex);
+    if (best.size() < k || closerNeighbor(median, best.front())) {
+	best.push_back(median);
+	std::push_heap(best.begin(), best.end(), worse);
+	if (best.size() > k) {
+	    std::pop_heap(best.begin(), best.end(), worse);
+	    best.pop_back();
+	}
+    }
 
-    /**
-     * Now we traverse back up the tree, comparing the currentBest point to its parents
-     * We also decide whether we need to traverse the parent's subtrees
-     */
-    if (shouldReplace(query, points[currentBest], points[medianIndex]))
-	    currentBest = medianIndex;
+    //and search the other subtree if it could hold a neighbor better than the worst one kept
+    double diff = points[medianIndex][dim] - query[dim];
+    if (best.size() < k || diff * diff <= best.front().first) {
+	if (searchedLeft)
+	    kNearestIndices(query, medianIndex + 1, high, (dim + 1) % Dim, k, best);
+	else
+	    kNearestIndices(query, low, medianIndex - 1, (dim + 1) % Dim, k, best);
+    }
+}
 
-    int diff = std::abs(points[medianIndex][dim] - query[dim]);
-    diff = diff * diff;
+/**
+ * withinRadiusIndices
+ * the helper function for 'findWithinRadius'
+ * @param query 	- the point we want to find the neighbors of
+ * @param low   	- the lower index of the list of points we want to compare
+ * @param high  	- the upper index of the list of points we want to compare
+ * @param dim   	- the current splitting dimension we are working with
+ * @param radiusSquared - the square of the largest distance to 'query' a point may be
+ * @param found 	- the neighbors found so far
+ */
+template<int Dim>
+void KDTree<Dim>::withinRadiusIndices(const Point<Dim> & query, int low, int high, int dim, double radiusSquared,
+	vector< std::pair<double, int> > & found) const {
+    if (low > high)
+	return;
 
-    if (diff <= distanceSquared(query, points[currentBest])) {
-	//the index that will potentially be better than 'currentBest'
-	int potentialBestIndex;
+    int medianIndex = (low + high) / 2;
+    double distance = distanceSquared(query, points[medianIndex]);
+    if (distance <= radiusSquared)
+	found.push_back(std::make_pair(distance, medianIndex));
+
+    //a subtree can only hold neighbors if its side of the splitting plane is within range
+    double diff = points[medianIndex][dim] - query[dim];
+    bool left = smallerDimVal(query, points[medianIndex], dim);
+    if (left || diff * diff <= radiusSquared)
+	withinRadiusIndices(query, low, medianIndex - 1, (dim + 1) % Dim, radiusSquared, found);
+    if (!left || diff * diff <= radiusSquared)
+	withinRadiusIndices(query, medianIndex + 1, high, (dim + 1) % Dim, radiusSquared, found);
+}
 
-	if (currentBest >= medianIndex)
-	    potentialBestIndex = nearestIndex(query, low, medianIndex - 1, (dim + 1) % Dim);
-	else 
-	    potentialBestIndex = nearestIndex(query, medianIndex + 1, high, (dim + 1) % Dim);
+/**
+ * packPoint
+ * Converts a point to its packed form
+ * @param p   -	the point to pack
+ * @param out -	packedStride bytes to write the packed point into
+ * @return whether every coordinate of 'p' is an integer in [0, 255]
+ */
+template<int Dim>
+bool KDTree<Dim>::packPoint(const Point<Dim> & p, uint8_t * out) {
+    for (int i = 0; i < Dim; i++) {
+	double val = p[i];
+	if (!(val >= 0 && val <= 255) || val != static_cast<int>(val))
+	    return false;
+	out[i] = static_cast<uint8_t>(val);
+    }
+    return true;
+}
 
-	//check if it is indeed better than 'currentBest' or not
-	if (shouldReplace(query, points[currentBest], points[potentialBestIndex]))
-	    currentBest = potentialBestIndex;
+/**
+ * packedSmallerDimVal
+ * smallerDimVal for packed nodes, breaking ties with packedLess
+ */
+template<int Dim>
+bool KDTree<Dim>::packedSmallerDimVal(const uint8_t * first, const uint8_t * second, int curDim) {
+    if (first[curDim] != second[curDim])
+	return first[curDim] < second[curDim];
+    return packedLess(first, second);
+}
+
+/**
+ * packedLess
+ * Point::operator< for packed nodes: the first differing coordinate decides
+ */
+template<int Dim>
+bool KDTree<Dim>::packedLess(const uint8_t * first, const uint8_t * second) {
+    for (int i = 0; i < Dim; i++) {
+	if (first[i] != second[i])
+	    return first[i] < second[i];
+    }
+    return false;
+}
+
+/**
+ * packedDistanceSquared
+ * distanceSquared for packed nodes, computed exactly in integers
+ */
+template<int Dim>
+int KDTree<Dim>::packedDistanceSquared(const uint8_t * a, const uint8_t * b) {
+    int d = 0;
+    for (int i = 0; i < Dim; i++) {
+	int diff = a[i] - b[i];
+	d += diff * diff;
+    }
+    return d;
+}
+
+/**
+ * packedNearestIndex
+ * nearestIndex over the packed copy of the tree. Searches the same way, but with
+ * exact integer distances, so the bound on each subtree is updated incrementally.
+ * @param query 	- the packed point we want to find the closest point to
+ * @param low   	- the lower index of the list of points we want to compare
+ * @param high  	- the upper index of the list of points we want to compare
+ * @param dim   	- the current splitting dimension we are working with
+ * @param bestDistance 	- set to the squared distance to the returned point
+ * @return the index of the point closest to 'query', or -1 if the range is empty
+ */
+template<int Dim>
+int KDTree<Dim>::packedNearestIndex(const uint8_t * query, int low, int high, int dim, int & bestDistance) const {
+    if (low > high)
+	return -1;
+
+    struct Pending {
+	int low;
+	int high;
+	int dim;
+	int bound;
+	int offsets[Dim];
+    };
+    Pending stack[maxSearchDepth];
+    int top = 0;
+
+    stack[top].low = low;
+    stack[top].high = high;
+    stack[top].dim = dim;
+    stack[top].bound = 0;
+    for (int d = 0; d < Dim; d++)
+	stack[top].offsets[d] = 0;
+    top++;
+
+    int currentBest = -1;
+    bestDistance = 0;
+    while (top > 0) {
+	Pending node = stack[--top];
+	if (currentBest != -1 && node.bound > bestDistance)
+	    continue;
+
+	while (node.low <= node.high) {
+	    int medianIndex = (node.low + node.high) / 2;
+	    const uint8_t * median = &packedPoints[medianIndex * packedStride];
+
+	    int distance = packedDistanceSquared(query, median);
+	    if (currentBest == -1 || distance < bestDistance || (distance == bestDistance
+			&& packedLess(median, &packedPoints[currentBest * packedStride]))) {
+		currentBest = medianIndex;
+		bestDistance = distance;
+	    }
+
+	    bool searchLeft = packedSmallerDimVal(query, median, node.dim);
+	    int nextDim = (node.dim + 1) % Dim;
+	    int offset = query[node.dim] - median[node.dim];
+	    Pending far = node;
+	    far.dim = nextDim;
+	    far.bound += offset * offset - node.offsets[node.dim] * node.offsets[node.dim];
+	    far.offsets[node.dim] = offset;
+	    if (searchLeft) {
+		far.low = medianIndex + 1;
+		node.high = medianIndex - 1;
+	    } else {
+		far.high = medianIndex - 1;
+		node.low = medianIndex + 1;
+	    }
+	    node.dim = nextDim;
+
+	    if (far.low <= far.high && (currentBest == -1 || far.bound <= bestDistance))
+		stack[top++] = far;
+	}
     }
 
-    //return the best index
     return currentBest;
 }
@@ -18,7 +18,11 @@
 #define _KDTREE_H_
 
 #include <vector>
+#include <cstdint>
+#include <functional>
+#include <map>
 #include "coloredout.h"
+#include "parallel.h"
 #include "point.h"
 #include <algorithm>
 
@@ -148,10 +152,25 @@ class KDTree
          * that "select pivotIndex between left and right" means that you
          * should choose a midpoint between the left and right indices. 
          *
+         * If every coordinate of every point is an integer in [0, 255]
+         * (as is the case for RGB colors), the tree additionally keeps a
+         * packed copy of its coordinates, one byte per dimension padded
+         * to a multiple of four bytes per node. Queries with byte-valued
+         * coordinates are then answered from the packed copy using
+         * integer distances, which gives the same results as searching
+         * the Points themselves while touching far less memory. Trees
+         * holding mine points are never packed, so that the mines still
+         * catch searches that look at nodes they don't need to.
+         *
+         * The tree can also be built on several threads. The result is the
+         * same tree no matter how many threads are used.
+         *
          * @todo This function is required for MP 6.1.
          * @param newPoints The vector of points to build your KDTree off of.
+         * @param allowPacked Whether the packed storage mode may be used.
+         * @param numThreads The number of threads to build the tree with.
          */
-        KDTree(const vector< Point<Dim> > & newPoints);
+        KDTree(const vector< Point<Dim> > & newPoints, bool allowPacked = true, int numThreads = 1);
         
         /**
          * Finds the closest point to the parameter point in the KDTree.
@@ -211,6 +230,97 @@ class KDTree
          */
         Point<Dim> findNearestNeighbor(const Point<Dim> & query) const;
 
+        /**
+         * Finds the closest point in the tree to each of a batch of query
+         * points. The result for each query is the same as calling
+         * findNearestNeighbor() on it.
+         *
+         * The queries are answered in Morton (Z-curve) order rather than
+         * the order given, so that consecutive searches follow mostly the
+         * same path through the tree and find it already in cache, and
+         * repeated queries are only searched once. The batch may also be
+         * split across several threads.
+         *
+         * @param queries The points we wish to find the closest neighbors to.
+         * @param numThreads The number of threads to search with.
+         * @return The closest point in the tree to each query, in the same
+         *  order as queries.
+         */
+        vector< Point<Dim> > findNearestNeighbors(const vector< Point<Dim> > & queries,
+                int numThreads = 1) const;
+
+        /**
+         * Finds the closest point in the tree to the parameter point that
+         * is not skipped, for example because it has been removed from a
+         * set the tree was built from. This searches the same way as
+         * findNearestNeighbor(), and breaks ties the same way, but passes
+         * over the points skip accepts. Subtrees are still pruned, so a
+         * query only pays for the skipped points it actually visits.
+         *
+         * @param query The point we wish to find the closest neighbor to.
+         * @param skip Whether a point should be passed over.
+         * @param nearest Set to the closest point not skipped, if any.
+         * @return Whether there is a point that is not skipped.
+         */
+        bool findNearestNeighbor(const Point<Dim> & query,
+                const std::function<bool(const Point<Dim> &)> & skip, Point<Dim> & nearest) const;
+
+        /**
+         * Finds the k closest points in the tree to the parameter point,
+         * for example to pick among several good tiles rather than always
+         * the single best one.
+         *
+         * The search keeps the k best points found so far in a bounded
+         * max-heap, and prunes a subtree exactly as findNearestNeighbor()
+         * does, using the distance to the worst of those k points (or no
+         * bound at all until k points have been found). Ties in distance
+         * are decided using Point::operator<(), so the first point found
+         * is always the one findNearestNeighbor() returns.
+         *
+         * @param query The point we wish to find the closest neighbors to.
+         * @param k The number of neighbors to find.
+         * @return The min(k, size) closest points to query, closest first.
+         */
+        vector< Point<Dim> > findKNearest(const Point<Dim> & query, int k) const;
+
+        /**
+         * Finds every point in the tree within a given distance of the
+         * parameter point. A subtree is skipped whenever its splitting
+         * plane is farther from query than the radius.
+         *
+         * @param query The point we wish to find the neighbors of.
+         * @param radiusSquared The square of the largest distance from
+         *  query a point may be.
+         * @return The points at most that far from query, closest first,
+         *  with ties decided using Point::operator<().
+         */
+        vector< Point<Dim> > findWithinRadius(const Point<Dim> & query, double radiusSquared) const;
+
+        /**
+         * Whether this tree is using the packed byte storage mode described
+         * in the constructor documentation.
+         * @return true if nearest neighbor queries may use packed storage.
+         */
+        bool isPacked() const;
+
+        /**
+         * Gets the tree's nodes in the order it stores them: the root of
+         * the subtree over the range [low, high] is at (low + high) / 2,
+         * with its left subtree before it and its right subtree after it.
+         * @return The nodes of the tree.
+         */
+        const vector< Point<Dim> > & getNodes() const;
+
+        /**
+         * Creates a tree from nodes that are already in the order
+         * getNodes() gives, such as ones saved from another tree, without
+         * building it again.
+         * @param nodes The nodes of the tree.
+         * @param allowPacked Whether the packed storage mode may be used.
+         * @return The tree.
+         */
+        static KDTree<Dim> fromNodes(const vector< Point<Dim> > & nodes, bool allowPacked = true);
+
         // functions used for grading:
         
         /**
@@ -231,6 +341,21 @@ class KDTree
         /** This is your KDTree representation. Modify this vector to create a KDTree. */
         vector< Point<Dim> > points;
 
+        /** Most subtrees a nearest neighbor search can have waiting at once. */
+        static const int maxSearchDepth = 64;
+
+        /** Subtrees at most this large are built on a single thread. */
+        static const int parallelBuildThreshold = 8192;
+
+        /** Bytes used by one node in the packed storage mode. */
+        static const int packedStride = (Dim + 3) / 4 * 4;
+
+        /**
+         * Packed copy of points in the same order, packedStride bytes per
+         * node. Empty unless the tree is in the packed storage mode.
+         */
+        vector<uint8_t> packedPoints;
+
         /** Helper function for grading */
         int getPrintData(int low, int high) const;
 
@@ -238,21 +363,95 @@ class KDTree
         void printTree(int low, int high, std::vector<std::string> & output,
                 int left, int top, int width, int currd) const;
 
+        /**
+         * A point while the tree is being built: its index in the points
+         * the tree is built from, and its coordinate in the dimension
+         * currently being split.
+         */
+        struct BuildNode {
+            double key;
+            int index;
+        };
+
+        /** Creates an empty tree, for fromNodes. */
+        KDTree() {}
+
         //Helper Functions
+	/* builds the packed copy of 'points' if every coordinate fits in a byte */
+	void pack();
+
 	/* recursive helper for constructor */
-	void construct(vector< Point<Dim> > & list, int low, int high, int n, int dim);
+	void construct(const vector< Point<Dim> > & list, vector<BuildNode> & order, int low, int high, int n, int dim);
+
+	/* multithreaded version of construct over the whole of 'order' */
+	void constructParallel(const vector< Point<Dim> > & list, vector<BuildNode> & order, int numThreads);
+
+	/* copies the coordinates in 'dim' of a range of 'order' into its keys */
+	void loadKeys(const vector< Point<Dim> > & list, vector<BuildNode> & order, int low, int high, int dim);
 
 	/* select function that uses partition */
-	void select(vector< Point<Dim> > & list, int low, int high, int n, int dim);
+	void select(const vector< Point<Dim> > & list, vector<BuildNode> & order, int low, int high, int n);
+
+	/* three-way comparison of nodes whose keys are loaded */
+	static int compareNodes(const vector< Point<Dim> > & list, const BuildNode & first, const BuildNode & second);
+
+	/* index of the median of three nodes */
+	static int medianOfThree(const vector< Point<Dim> > & list, const vector<BuildNode> & order, int a, int b, int c);
 
-	/* Recursive helper function for use in building the k-d tree */
-	int partition(vector< Point<Dim> > & list, int low, int high, int pivotIndex, int dim);
+	/* pivot for select from a few samples of the range */
+	static int samplePivot(const vector< Point<Dim> > & list, const vector<BuildNode> & order, int low, int high);
+
+	/* pivot for select with a guaranteed split of the range */
+	int medianOfMedians(const vector< Point<Dim> > & list, vector<BuildNode> & order, int low, int high);
+
+	/* Three-way partition function for use in building the k-d tree */
+	int partition(const vector< Point<Dim> > & list, vector<BuildNode> & order, int low, int high, int pivotIndex,
+		int & equalHigh);
 
 	/* distance^2 calculator */
 	double distanceSquared(const Point<Dim> & a, const Point<Dim> & b) const;
 
  	/* helper function for the NNS search */
-	int nearestIndex(const Point<Dim> & query, int low, int high, int dim) const;
+	int nearestIndex(const Point<Dim> & query, int low, int high, int dim,
+		const std::function<bool(const Point<Dim> &)> * skip = NULL) const;
+
+	/* whether neighbor 'first' is closer than 'second', as (distance^2, index) pairs */
+	bool closerNeighbor(const std::pair<double, int> & first, const std::pair<double, int> & second) const;
+
+	/* merge sorts neighbors closest first by closerNeighbor */
+	void sortNeighbors(vector< std::pair<double, int> > & neighbors) const;
+
+	/* helper function for findKNearest: keeps the k best neighbors in the max-heap 'best' */
+	void kNearestIndices(const Point<Dim> & query, int low, int high, int dim, size_t k,
+		vector< std::pair<double, int> > & best) const;
+
+	/* helper function for findWithinRadius: adds the neighbors within range to 'found' */
+	void withinRadiusIndices(const Point<Dim> & query, int low, int high, int dim, double radiusSquared,
+		vector< std::pair<double, int> > & found) const;
+
+	/* packs 'p' into 'out' if all of its coordinates are bytes */
+	static bool packPoint(const Point<Dim> & p, uint8_t * out);
+
+	/* smallerDimVal on packed nodes */
+	static bool packedSmallerDimVal(const uint8_t * first, const uint8_t * second, int curDim);
+
+	/* operator< on packed nodes */
+	static bool packedLess(const uint8_t * first, const uint8_t * second);
+
+	/* integer distance^2 between packed nodes */
+	static int packedDistanceSquared(const uint8_t * a, const uint8_t * b);
+
+	/* Morton order key of 'p' within the box [minVals, maxVals] */
+	static uint64_t mortonKey(const Point<Dim> & p, const double * minVals, const double * maxVals);
+
+	/* the number of bits each dimension gets in a Morton key */
+	static const int mortonBits = 64 / Dim < 16 ? 64 / Dim : 16;
+
+	/* radix sorts (Morton key, index) pairs by key, keeping equal keys in order */
+	static void sortByMortonKey(vector< std::pair<uint64_t, size_t> > & order);
+
+	/* helper function for the NNS search in the packed storage mode */
+	int packedNearestIndex(const uint8_t * query, int low, int high, int dim, int & bestDistance) const;
 };
 
 #include "kdtree.cpp"
@@ -5,17 +5,16 @@
 	 			
 #include <iostream>
 #include <map>
+#include <unordered_set>
 #include "maptiles.h"
+#include "parallel.h"
 
 using namespace std;
 
-MosaicCanvas * mapTiles(SourceImage const & theSource, vector<TileImage> const & theTiles)
+MosaicCanvas * mapTiles(SourceImage const & theSource, vector<TileImage> const & theTiles, int numThreads)
 {
-    //the pointer to a 'MosaicCanvas' we will return
-    MosaicCanvas * mosaic = new MosaicCanvas(theSource.getRows(), theSource.getColumns());
-
-    //a std::map of the TileImages in 'theTiles' and their average color values
-    map< Point<3>, TileImage> tileImages;
+    //a std::map of the average color values of the TileImages to their index in 'theTiles'
+    map< Point<3>, size_t> tileImages;
 
     //a vector containing the average color values of the given TileImages
     vector< Point<3> > tileColors;
@@ -30,34 +29,99 @@ MosaicCanvas * mapTiles(SourceImage const & theSource, vector<TileImage> const &
 	Point<3> p(r.red, r.green, r.blue);
 
 	tileColors.push_back(p);
-	tileImages[p] = theTiles[i];
+	tileImages[p] = i;
     }
 
     //construct the kd-tree using 'tileColors'
-    KDTree<3> regionColors(tileColors);
+    KDTree<3> regionColors(tileColors, true, numThreads);
+
+    //the tile that each node of the kd-tree stands for
+    const vector< Point<3> > & nodes = regionColors.getNodes();
+    vector<size_t> nodeTiles(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++)
+	nodeTiles[i] = tileImages[nodes[i]];
+
+    /**
+     * the canvas' cells refer to tiles by index in a shared copy of 'theTiles'
+     * (which shares their pixels)
+     */
+    return mapTiles(theSource, make_shared<const vector<TileImage> >(theTiles), regionColors, nodeTiles, numThreads);
+}
+
+MosaicCanvas * mapTiles(SourceImage const & theSource, shared_ptr<const vector<TileImage> > theTiles,
+	KDTree<3> const & regionColors, vector<size_t> const & nodeTiles, int numThreads,
+	TileLookupTable * lookupTable)
+{
+    //the lookup table stores tile indices as uint32s, with the largest one marking unknown colors
+    if (theTiles->size() >= TileLookupTable::unknown)
+	return NULL;
 
     /**
-     * here we use a nested for loop to find the nearest neighbor of each region in the source image
-     * and set the corresponding TileImage in the MosaicCanvas we are going to return
+     * the pointer to a 'MosaicCanvas' we will return. Its cells refer to tiles by
+     * index in 'theTiles'
      */
-    for (int i = 0; i < mosaic->getRows(); i++) {
-	for (int j = 0; j < mosaic->getColumns(); j++) {
-	    //the region color in theSource at coordinates (i, j)
-	    RGBAPixel regionColor = theSource.getRegionColor(i, j);
+    MosaicCanvas * mosaic = new MosaicCanvas(theSource.getRows(), theSource.getColumns(), theTiles);
+    int rows = mosaic->getRows();
+    int columns = mosaic->getColumns();
 
-	    //the Point<3> that will represent 'regionColor'
-	    Point<3> p(regionColor.red, regionColor.green, regionColor.blue);
+    //a std::map of the colors of the kd-tree's nodes to the index of their tile
+    map< Point<3>, size_t> tileImages;
+    const vector< Point<3> > & nodes = regionColors.getNodes();
+    for (size_t i = 0; i < nodes.size(); i++)
+	tileImages[nodes[i]] = nodeTiles[i];
 
-	    //the nearest neighbor to 'p'
-	    Point<3> nearest = regionColors.findNearestNeighbor(p);
+    //without a lookup table from the caller, one is only kept for this mosaic
+    TileLookupTable localTable;
+    TileLookupTable & table = lookupTable != NULL ? *lookupTable : localTable;
 
-	    //the TileImage that nearest represents
- 	    TileImage t = tileImages[nearest];
+    /**
+     * the average color of every region in the source image, in row-major order.
+     * Each thread fills in whole rows, so no two threads write the same element
+     */
+    vector<RGBAPixel> regions(rows * columns);
+    util::forEachChunk(rows, 1, numThreads, [&](size_t begin, size_t end) {
+	for (int i = begin; i < (int) end; i++) {
+	    for (int j = 0; j < columns; j++) {
+		regions[i * columns + j] = theSource.getRegionColor(i, j);
+	    }
+	}
+    });
 
-	    //add that TileImage to the MosaicCanvas
-	    mosaic->setTile(i, j, t);
-  	}
+    /**
+     * the region colors that the lookup table does not know yet, or maps to something that is not
+     * one of 'theTiles', each only once
+     */
+    unordered_set<uint32_t> missingKeys;
+    vector<RGBAPixel> missing;
+    vector< Point<3> > missingColors;
+    for (size_t i = 0; i < regions.size(); i++) {
+	if (table.lookup(regions[i]) < theTiles->size())
+	    continue;
+	uint32_t key = (regions[i].red << 16) | (regions[i].green << 8) | regions[i].blue;
+	if (!missingKeys.insert(key).second)
+	    continue;
+	missing.push_back(regions[i]);
+	missingColors.push_back(Point<3>(regions[i].red, regions[i].green, regions[i].blue));
     }
 
+    //find the nearest neighbor of every missing color at once, and remember their tiles
+    vector< Point<3> > nearest = regionColors.findNearestNeighbors(missingColors, numThreads);
+    for (size_t i = 0; i < missing.size(); i++)
+	table.insert(missing[i], tileImages.find(nearest[i])->second);
+
+    /**
+     * here we use a nested for loop to set the TileImage that each region's color
+     * maps to in the MosaicCanvas we are going to return. Again each thread sets
+     * whole rows of tiles, and the table is only read
+     */
+    util::forEachChunk(rows, 1, numThreads, [&](size_t begin, size_t end) {
+	for (int i = begin; i < (int) end; i++) {
+	    for (int j = 0; j < columns; j++) {
+		//add the TileImage for region (i, j) to the MosaicCanvas
+		mosaic->setTile(i, j, table.lookup(regions[i * columns + j]));
+	    }
+	}
+    });
+
     return mosaic;
 }
@@ -18,6 +18,7 @@
 #include "mosaiccanvas.h"
 #include "sourceimage.h"
 #include "tileimage.h"
+#include "tilelookuptable.h"
 
 using namespace std;
 
@@ -25,10 +26,43 @@ using namespace std;
  * Map the image tiles into a mosaic canvas which closely
  * matches the input image.
  *
+ * The regions of the source image are matched independently, so the work
+ * can be split by rows across several threads. The resulting canvas is the
+ * same no matter how many threads are used.
+ *
  * @todo This function is required for MP 6.2.
  * @param theSource The input image to construct a photomosaic of
  * @param theTiles The tiles image to use in the mosaic
+ * @param numThreads The number of threads to match regions with
+ */
+MosaicCanvas * mapTiles(SourceImage const & theSource, vector<TileImage> const & theTiles,
+		int numThreads = 1);
+
+/**
+ * Map the image tiles into a mosaic canvas which closely
+ * matches the input image, using a KDTree of the tiles'
+ * average colors that has already been built (for example,
+ * one loaded from a saved tile library).
+ *
+ * Each distinct region color is only searched for once. If a lookup
+ * table is given, colors it already knows are not searched for at all,
+ * and the colors that are searched for are added to it, so that a table
+ * filled on one run can be reused on the next run with the same tiles.
+ * Entries of the table that are not tiles of theTiles are searched for
+ * again and replaced.
+ *
+ * @param theSource The input image to construct a photomosaic of
+ * @param theTiles The tiles image to use in the mosaic
+ * @param tileColors A KDTree of the average colors of theTiles
+ * @param nodeTiles The index in theTiles of the tile each of
+ *  tileColors' nodes (in getNodes() order) stands for
+ * @param numThreads The number of threads to match regions with
+ * @param lookupTable Tiles already chosen for region colors, or NULL
+ * @return The canvas, or NULL if there are too many tiles for a
+ *  lookup table to refer to
  */
-MosaicCanvas * mapTiles(SourceImage const & theSource, vector<TileImage> const & theTiles);
+MosaicCanvas * mapTiles(SourceImage const & theSource, shared_ptr<const vector<TileImage> > theTiles,
+		KDTree<3> const & tileColors, vector<size_t> const & nodeTiles, int numThreads = 1,
+		TileLookupTable * lookupTable = NULL);
 
 #endif // MAPTILES_H
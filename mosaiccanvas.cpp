@@ -2,18 +2,97 @@
  * @file mosaiccanvas.h
  */
 
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <sys/stat.h>
 #include <errno.h>
 #include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
 
 #include "mosaiccanvas.h"
+#include "parallel.h"
 #include "util.h"
 
 using namespace std;
 using namespace util;
 
 bool MosaicCanvas::enableOutput = false;
+const uint32_t MosaicCanvas::noTile;
+
+/**
+ * Guards progress output, since tiles may be set from several threads.
+ */
+static mutex outputMutex;
+
+namespace
+{
+
+/**
+ * Progress output for work done on several threads at once. Progress is
+ * printed at most every few hundred milliseconds, and by whichever thread
+ * gets there first; no thread ever waits to print.
+ */
+class ProgressReporter
+{
+	public:
+	ProgressReporter(const string & theMessage, size_t theTotal)
+		: message(theMessage), total(theTotal), done(0), lastReport(chrono::steady_clock::now())
+	{
+		print(0);
+	}
+
+	/**
+	 * Records that more of the work is done.
+	 * @param amount How many more units of work are done.
+	 */
+	void advance(size_t amount)
+	{
+		size_t nowDone = (done += amount);
+		if (!MosaicCanvas::enableOutput)
+			return;
+
+		unique_lock<mutex> lock(outputMutex, try_to_lock);
+		if (!lock.owns_lock())
+			return;
+		chrono::steady_clock::time_point now = chrono::steady_clock::now();
+		if (now - lastReport < chrono::milliseconds(250))
+			return;
+		lastReport = now;
+		print(nowDone);
+	}
+
+	/**
+	 * Prints the final progress line. Call once all the work is done.
+	 */
+	void finish()
+	{
+		if (!MosaicCanvas::enableOutput)
+			return;
+		lock_guard<mutex> lock(outputMutex);
+		cerr << "\r" << string(60, ' ');
+		cerr << "\r" << message << " (" << total << "/" << total << ")" << endl;
+		cerr.flush();
+	}
+
+	private:
+	void print(size_t count)
+	{
+		if (!MosaicCanvas::enableOutput)
+			return;
+		cerr << "\r" << message << " (" << count << "/" << total << ")" << string(20, ' ') << "\r";
+		cerr.flush();
+	}
+
+	string message;
+	size_t total;
+	atomic<size_t> done;
+	chrono::steady_clock::time_point lastReport; // guarded by outputMutex
+};
+
+}
 
 /**
  * Constructor.
@@ -22,7 +101,8 @@ bool MosaicCanvas::enableOutput = false;
  * @param theColumns Number of columns to divide the canvas into
  */
 MosaicCanvas::MosaicCanvas(int theRows, int theColumns)
-	: rows(theRows), columns(theColumns)
+	: rows(theRows), columns(theColumns), library(make_shared<const vector<TileImage> >()),
+	  peakScaledTiles(0)
 {
 	if ((theRows < 1) || (theColumns < 1))
 	{
@@ -30,7 +110,26 @@ MosaicCanvas::MosaicCanvas(int theRows, int theColumns)
 		exit(-1);
 	}
 
-	myImages.resize(rows * columns);
+	myTiles.resize(rows * columns, noTile);
+}
+
+/**
+ * Constructor for a canvas whose tiles are chosen from a library.
+ *
+ * @param theRows Number of rows to divide the canvas into
+ * @param theColumns Number of columns to divide the canvas into
+ * @param theLibrary The tiles that tile ids refer to
+ */
+MosaicCanvas::MosaicCanvas(int theRows, int theColumns, shared_ptr<const vector<TileImage> > theLibrary)
+	: rows(theRows), columns(theColumns), library(theLibrary), peakScaledTiles(0)
+{
+	if ((theRows < 1) || (theColumns < 1))
+	{
+		cerr << "Error: Cannot set non-positive rows or columns" << endl;
+		exit(-1);
+	}
+
+	myTiles.resize(rows * columns, noTile);
 }
 
 /**
@@ -55,12 +154,41 @@ int MosaicCanvas::getColumns() const
 
 void MosaicCanvas::setTile(int row, int column, const TileImage & i)
 {
+	// A cell that already holds a tile set by value keeps its slot, so
+	// setting the same cells over and over doesn't grow extraTiles
+	size_t id = tileId(row, column);
+	{
+		lock_guard<mutex> lock(extraTilesMutex);
+		if (id != noTile && id >= library->size())
+			extraTiles[id - library->size()] = i;
+		else
+		{
+			id = library->size() + extraTiles.size();
+			extraTiles.push_back(i);
+		}
+	}
+	setTile(row, column, id);
+}
+
+void MosaicCanvas::setTile(int row, int column, size_t id)
+{
+	if (id >= noTile)
+	{
+		cerr << "Error: Tile id " << id << " is too large for the canvas" << endl;
+		exit(-1);
+	}
+
 	if (enableOutput)
 	{
-		cerr << "\rPopulating Mosaic: setting tile (" << row << ", " << column << ")" << string(20, ' ') << "\r";
-		cerr.flush();
+		// Skip the update rather than wait if another thread is printing
+		unique_lock<mutex> lock(outputMutex, try_to_lock);
+		if (lock.owns_lock())
+		{
+			cerr << "\rPopulating Mosaic: setting tile (" << row << ", " << column << ")" << string(20, ' ') << "\r";
+			cerr.flush();
+		}
 	}
-	images(row, column) = i;
+	tileId(row, column) = id;
 }
 
 const TileImage & MosaicCanvas::getTile(int row, int column) const
@@ -68,8 +196,31 @@ const TileImage & MosaicCanvas::getTile(int row, int column) const
 	return images(row, column);
 }
 
+vector<size_t> MosaicCanvas::getUsedTiles() const
+{
+	vector<bool> used(library->size(), false);
+	for (size_t i = 0; i < myTiles.size(); i++)
+		if (myTiles[i] < library->size())
+			used[myTiles[i]] = true;
+
+	vector<size_t> ids;
+	for (size_t id = 0; id < used.size(); id++)
+		if (used[id])
+			ids.push_back(id);
+	return ids;
+}
 
-PNG MosaicCanvas::drawMosaic(int pixelsPerTile) const
+size_t MosaicCanvas::getPeakScaledTiles() const
+{
+	return peakScaledTiles;
+}
+
+void MosaicCanvas::setAtlas(shared_ptr<const TileAtlas> theAtlas)
+{
+	atlas = theAtlas;
+}
+
+PNG MosaicCanvas::drawMosaic(int pixelsPerTile, int numThreads) const
 {
 	if (pixelsPerTile <= 0)
 	{
@@ -84,34 +235,183 @@ PNG MosaicCanvas::drawMosaic(int pixelsPerTile) const
 	// Create the image
 	PNG mosaic(width, height);
 
-	// Create list of drawable tiles
-	for (int row = 0; row < rows; row++)
+	ScaledTiles scaled;
+	peakScaledTiles = 0;
+	scaleTiles(pixelsPerTile, numThreads, 0, rows, scaled);
+
+	// Then copy them into place row by row. Bands of tile rows are split
+	// across threads; each tile row covers its own rows of pixels
+	ProgressReporter progress("Drawing Mosaic: resizing tiles", rows * columns);
+	size_t bandRows = max(1, rows / (4 * max(numThreads, 1)));
+	forEachChunk(rows, bandRows, numThreads, [&](size_t begin, size_t end)
 	{
-		if (enableOutput)
+		for (int row = begin; row < (int) end; row++)
 		{
-			cerr << "\rDrawing Mosaic: resizing tiles (" << (row*columns + /*col*/ 0 + 1) << "/" << (rows*columns) << ")" << string(20, ' ') << "\r";
-			cerr.flush();
+			drawRow(scaled, pixelsPerTile, row, mosaic, 0);
+			progress.advance(columns);
 		}
-		for (int col = 0; col < columns; col++)
+	});
+	progress.finish();
+
+	return mosaic;
+}
+
+bool MosaicCanvas::writeMosaic(const string & fileName, int pixelsPerTile, int numThreads,
+		const PNGWriteOptions & options) const
+{
+	if (pixelsPerTile <= 0)
+	{
+		cerr << "ERROR: pixelsPerTile must be > 0" << endl;
+		exit(-1);
+	}
+
+	int width = columns * pixelsPerTile;
+	int height = rows * pixelsPerTile;
+
+	// Scaling always gives opaque pixels, so the mosaic is opaque unless
+	// one of the atlas tiles it copies straight in is not
+	bool opaque = true;
+	if (atlas)
+	{
+		int resolution = atlas->getTileResolution();
+		vector<size_t> usedTiles = getUsedTiles();
+		for (size_t i = 0; i < usedTiles.size() && usedTiles[i] < atlas->size() && opaque; i++)
+		{
+			PNGView tile(atlas->tile(usedTiles[i]), resolution, resolution, resolution);
+			for (size_t y = 0; y < tile.height() && opaque; y++)
+				for (size_t x = 0; x < tile.width() && opaque; x++)
+					opaque = tile.row(y)[x].alpha == 255;
+		}
+	}
+
+	PNGWriter writer;
+	if (!writer.open(fileName, width, height, options, opaque))
+		return false;
+
+	// Draw one band of tile rows at a time, one tile row per thread, and
+	// hand its pixel rows to the writer before drawing the next band. Only
+	// the tiles the band uses are kept scaled
+	int bandRows = max(numThreads, 1);
+	PNG band(width, min(bandRows, rows) * pixelsPerTile);
+	ScaledTiles scaled;
+	peakScaledTiles = 0;
+	ProgressReporter progress("Drawing Mosaic: writing tiles", rows * columns);
+	for (int bandStart = 0; bandStart < rows; bandStart += bandRows)
+	{
+		int bandEnd = min(bandStart + bandRows, rows);
+		int bandStartY = divide(height * bandStart, getRows());
+		int bandEndY   = divide(height * bandEnd,   getRows());
+
+		scaleTiles(pixelsPerTile, numThreads, bandStart, bandEnd, scaled);
+		forEachChunk(bandEnd - bandStart, 1, numThreads, [&](size_t begin, size_t end)
 		{
-			int startX = divide(width  *  col,    getColumns());
-			int endX   = divide(width  * (col+1), getColumns());
-			int startY = divide(height *  row,    getRows());
-			int endY   = divide(height * (row+1), getRows());
+			for (int row = bandStart + begin; row < bandStart + (int) end; row++)
+				drawRow(scaled, pixelsPerTile, row, band, bandStartY);
+		});
+
+		for (int y = bandStartY; y < bandEndY; y++)
+			if (!writer.writeRow(band.row(y - bandStartY)))
+				return false;
+		progress.advance((bandEnd - bandStart) * columns);
+	}
+	progress.finish();
 
-			if (endX - startX != endY - startY)
-				cerr << "Error: resolution not constant: x: " << (endX - startX) << " y: " << (endY - startY) << endl;
+	return writer.close();
+}
+
+void MosaicCanvas::scaleTiles(int pixelsPerTile, int numThreads, int firstRow, int endRow,
+		ScaledTiles & scaled) const
+{
+	int width = columns * pixelsPerTile;
 
-			images(row, col).paste(mosaic, startX, startY, endX - startX);
+	// Each distinct tile is only scaled once for each size it is drawn at,
+	// keyed by its id and that size. First find which scaled tile each
+	// cell in the rows needs, and one cell to scale each of them from
+	unordered_map<uint64_t, uint32_t> scaledIndex;
+	vector<int> scaledFromCell;
+	ScaledTiles next;
+	next.firstRow = firstRow;
+	next.cellTile.resize((endRow - firstRow) * columns);
+	for (int row = firstRow; row < endRow; row++)
+	{
+		for (int col = 0; col < columns; col++)
+		{
+			int resolution = divide(width * (col+1), getColumns()) - divide(width * col, getColumns());
+			uint64_t key = (static_cast<uint64_t>(myTiles[row*columns + col]) << 32) | resolution;
+			pair<unordered_map<uint64_t, uint32_t>::iterator, bool> added =
+				scaledIndex.insert(make_pair(key, scaledFromCell.size()));
+			if (added.second)
+			{
+				scaledFromCell.push_back(row*columns + col);
+				next.keys.push_back(key);
+			}
+			next.cellTile[(row - firstRow)*columns + col] = added.first->second;
 		}
 	}
-	if (enableOutput)
+
+	// Tiles the previous rows were drawn from are moved over rather than
+	// scaled again, and the rest of them are freed before scaling any more
+	next.tiles.resize(scaledFromCell.size());
+	next.pixels.resize(scaledFromCell.size(), NULL);
+	next.resolutions.resize(scaledFromCell.size());
+	for (size_t i = 0; i < scaled.keys.size(); i++)
 	{
-		cerr << "\r" << string(60, ' ');
-		cerr << "\rDrawing Mosaic: resizing tiles (" << (rows*columns) << "/" << (rows*columns) << ")" << endl;
-		cerr.flush();
+		unordered_map<uint64_t, uint32_t>::const_iterator found = scaledIndex.find(scaled.keys[i]);
+		if (found == scaledIndex.end())
+			continue;
+		next.tiles[found->second] = move(scaled.tiles[i]);
+		next.pixels[found->second] = scaled.pixels[i];
 	}
+	scaled = move(next);
+	peakScaledTiles = max(peakScaledTiles.load(), scaled.keys.size());
 
-	return mosaic;
+	// Library tiles at the atlas' resolution are already scaled. Scale the
+	// rest of the distinct tiles in parallel
+	forEachChunk(scaled.tiles.size(), 1, numThreads, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			int row = scaledFromCell[i] / columns;
+			int col = scaledFromCell[i] % columns;
+			int resolution = divide(width * (col+1), getColumns()) - divide(width * col, getColumns());
+			uint32_t id = myTiles[scaledFromCell[i]];
+			scaled.resolutions[i] = resolution;
+			if (scaled.pixels[i] != NULL)
+				continue;
+			if (atlas && id < library->size() && id < atlas->size() && resolution == atlas->getTileResolution())
+			{
+				scaled.pixels[i] = atlas->tile(id);
+				continue;
+			}
+
+			PNG tile(resolution, resolution);
+			images(row, col).paste(tile, 0, 0, resolution);
+			scaled.tiles[i] = move(tile);
+			scaled.pixels[i] = scaled.tiles[i].row(0);
+		}
+	});
 }
 
+void MosaicCanvas::drawRow(const ScaledTiles & scaled, int pixelsPerTile, int row, PNG & target, int targetStartY) const
+{
+	int width = columns * pixelsPerTile;
+	int height = rows * pixelsPerTile;
+
+	for (int col = 0; col < columns; col++)
+	{
+		int startX = divide(width  *  col,    getColumns());
+		int endX   = divide(width  * (col+1), getColumns());
+		int startY = divide(height *  row,    getRows());
+		int endY   = divide(height * (row+1), getRows());
+
+		if (endX - startX != endY - startY)
+			cerr << "Error: resolution not constant: x: " << (endX - startX) << " y: " << (endY - startY) << endl;
+
+		int resolution = endX - startX;
+		const RGBAPixel * tile = scaled.pixels[scaled.cellTile[(row - scaled.firstRow)*columns + col]];
+		int copyWidth  = min(resolution, width - startX);
+		int copyHeight = min(resolution, height - startY);
+		for (int y = 0; y < copyHeight; y++)
+			memcpy(target.row(startY - targetStartY + y) + startX, tile + y * resolution, copyWidth * sizeof(RGBAPixel));
+	}
+}
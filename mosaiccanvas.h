@@ -13,8 +13,13 @@
 #ifndef MOSAICCANVAS_H
 #define MOSAICCANVAS_H
 
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include "png.h"
+#include "tileatlas.h"
 #include "tileimage.h"
 
 using namespace std;
@@ -23,6 +28,10 @@ using namespace std;
  * This is the actual mosaic data-structure which will hold the matrix
  * of sub-images to be written.  This is effectively just a 2-D array
  * of TileImage objects which can be accessed via convenience methods.
+ *
+ * Each cell only stores the id of its tile in a shared, immutable tile
+ * library, so the canvas takes O(cells + library) memory no matter how
+ * often the same tile is used.
  */
 class MosaicCanvas
 {
@@ -37,6 +46,15 @@ class MosaicCanvas
 	 */
 	MosaicCanvas(int theRows, int theColumns);
 
+	/**
+	 * Constructor for a canvas whose tiles are chosen from a library
+	 *
+	 * @param theRows Number of rows to divide the canvas into
+	 * @param theColumns Number of columns to divide the canvas into
+	 * @param theLibrary The tiles that tile ids refer to
+	 */
+	MosaicCanvas(int theRows, int theColumns, shared_ptr<const vector<TileImage> > theLibrary);
+
 	/**
 	 * Copy constructor
 	 *
@@ -61,6 +79,8 @@ class MosaicCanvas
 	/**
 	 * Set the TiledImage for a particular region.  Note
 	 * that row and tile indices should be zero-based.
+	 * Different regions may be set from different threads
+	 * at the same time.
 	 *
 	 * @param row The row
 	 * @param column The column
@@ -70,6 +90,19 @@ class MosaicCanvas
 	 */
 	void setTile(int row, int column, const TileImage & img);
 
+	/**
+	 * Set the tile for a particular region to a tile from
+	 * the library.  Note that row and tile indices should
+	 * be zero-based.  Different regions may be set from
+	 * different threads at the same time.
+	 *
+	 * @param row The row
+	 * @param column The column
+	 * @param tileId The index of the tile in the library,
+	 * which must be below UINT32_MAX
+	 */
+	void setTile(int row, int column, size_t tileId);
+
 	/**
 	 * Retrieve the current TileImage for a particular
 	 * row and column.  If the row or column is out of
@@ -84,13 +117,57 @@ class MosaicCanvas
 	 */
 	const TileImage & getTile(int row, int column) const;
 
+	/**
+	 * Retrieve the library tiles that the cells use
+	 *
+	 * @return The distinct ids of the library tiles in
+	 * the cells, in increasing order
+	 */
+	vector<size_t> getUsedTiles() const;
+
+	/**
+	 * Gives the canvas an atlas of the library's tiles, in
+	 * library order, already scaled to one resolution.
+	 * Tiles drawn at that resolution are then copied
+	 * straight from the atlas rather than scaled again.
+	 * Only the tiles in getUsedTiles() need to be packed.
+	 *
+	 * @param theAtlas The atlas
+	 */
+	void setAtlas(shared_ptr<const TileAtlas> theAtlas);
+
 	/**
 	 * Save the current MosaicCanvas as a file with
-	 * the following pixels per tile.
+	 * the following pixels per tile. The distinct tiles
+	 * are scaled once each and then copied into place,
+	 * and both steps may be split across threads.
      * @param pixelsPerTile pixels per Photomosaic tile
+     * @param numThreads number of threads to draw with
      * @return the Photomosaic as a PNG object
      */
-	PNG drawMosaic(int pixelsPerTile) const;
+	PNG drawMosaic(int pixelsPerTile, int numThreads = 1) const;
+
+	/**
+	 * Draw the current MosaicCanvas straight to a PNG file
+	 * with the following pixels per tile. Only one band of
+	 * tile rows, and the scaled tiles that band uses, are
+	 * held in memory at a time.
+	 * @param fileName file to write the Photomosaic to
+	 * @param pixelsPerTile pixels per Photomosaic tile
+	 * @param numThreads number of threads to draw with
+	 * @param options how to compress the file
+	 * @return whether the file was written successfully
+	 */
+	bool writeMosaic(const string & fileName, int pixelsPerTile, int numThreads = 1,
+			const PNGWriteOptions & options = PNGWriteOptions()) const;
+
+	/**
+	 * Retrieve how many scaled tiles the last call to
+	 * drawMosaic() or writeMosaic() held at once
+	 *
+	 * @return The most distinct scaled tiles held at once
+	 */
+	size_t getPeakScaledTiles() const;
 
 	private:
 	/**
@@ -104,24 +181,81 @@ class MosaicCanvas
 	int columns;
 
 	/**
-	 * The actual matrix of Image data
+	 * The id of the tile in each cell, in row-major order
 	 */
-	vector<TileImage> myImages;
+	vector<uint32_t> myTiles;
+
+	/**
+	 * Id of cells that have not been set
+	 */
+	static const uint32_t noTile = UINT32_MAX;
+
+	/**
+	 * The tiles that ids below library->size() refer to
+	 */
+	shared_ptr<const vector<TileImage> > library;
+
+	/**
+	 * Tiles set by value rather than by id, which are given
+	 * the ids following the library's
+	 */
+	vector<TileImage> extraTiles;
+	mutex extraTilesMutex;
+
+	/**
+	 * The tile shown in cells that have not been set
+	 */
+	TileImage defaultTile;
+
+	/**
+	 * The library's tiles pre-scaled to one resolution, if any
+	 */
+	shared_ptr<const TileAtlas> atlas;
+
+	/**
+	 * The most scaled tiles held at once by the last draw
+	 */
+	mutable atomic<size_t> peakScaledTiles;
+
+	/**
+	 * The distinct scaled tiles some rows of a mosaic are
+	 * drawn from, the tile id and resolution each is keyed
+	 * by, and which of them each cell in the rows uses,
+	 * starting at firstRow. Tiles are either scaled into
+	 * tiles or found in the atlas.
+	 */
+	struct ScaledTiles
+	{
+		vector<PNG> tiles;
+		vector<const RGBAPixel *> pixels;
+		vector<int> resolutions;
+		vector<uint64_t> keys;
+		vector<uint32_t> cellTile;
+		int firstRow;
+	};
+
+	void scaleTiles(int pixelsPerTile, int numThreads, int firstRow, int endRow, ScaledTiles & scaled) const;
+	void drawRow(const ScaledTiles & scaled, int pixelsPerTile, int row, PNG & target, int targetStartY) const;
 
-	TileImage & images(int x, int y);
-	const TileImage & images(int x, int y) const;
+	uint32_t & tileId(int row, int col);
+	const TileImage & images(int row, int col) const;
 
 	static uint64_t divide(uint64_t a, uint64_t b);
 };
 
-inline TileImage & MosaicCanvas::images(int row, int col)
+inline uint32_t & MosaicCanvas::tileId(int row, int col)
 {
-	return myImages[row*columns + col];
+	return myTiles[row*columns + col];
 }
 
 inline const TileImage & MosaicCanvas::images(int row, int col) const
 {
-	return myImages[row*columns + col];
+	uint32_t id = myTiles[row*columns + col];
+	if (id == noTile)
+		return defaultTile;
+	if (id < library->size())
+		return (*library)[id];
+	return extraTiles[id - library->size()];
 }
 
 inline uint64_t MosaicCanvas::divide(uint64_t a, uint64_t b)
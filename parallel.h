@@ -0,0 +1,73 @@
+/**
+ * @file parallel.h
+ * Helpers for splitting independent work across threads.
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace util
+{
+
+/**
+ * Gets the number of threads the hardware can run at once.
+ * @return The number of hardware threads, or 1 if it cannot be determined.
+ */
+inline int hardwareThreads()
+{
+	unsigned int count = std::thread::hardware_concurrency();
+	return count == 0 ? 1 : static_cast<int>(count);
+}
+
+/**
+ * Calls func(begin, end) on consecutive chunks covering [0, count), using
+ * up to numThreads threads including the calling thread. Chunks are handed
+ * out in order from a shared counter, so threads that finish early pick up
+ * more of the work. Returns once every chunk has been processed.
+ *
+ * @param count Number of work items.
+ * @param chunkSize Number of items handed to func at a time.
+ * @param numThreads Maximum number of threads to use.
+ * @param func Callable taking the (begin, end) item range of one chunk.
+ */
+template <typename Func>
+void forEachChunk(size_t count, size_t chunkSize, int numThreads, Func func)
+{
+	if (chunkSize == 0)
+		chunkSize = 1;
+	size_t numChunks = (count + chunkSize - 1) / chunkSize;
+	size_t numWorkers = std::min(static_cast<size_t>(std::max(numThreads, 1)), numChunks);
+
+	if (numWorkers <= 1)
+	{
+		for (size_t begin = 0; begin < count; begin += chunkSize)
+			func(begin, std::min(begin + chunkSize, count));
+		return;
+	}
+
+	std::atomic<size_t> nextChunk(0);
+	auto worker = [&]()
+	{
+		for (size_t chunk = nextChunk++; chunk < numChunks; chunk = nextChunk++)
+		{
+			size_t begin = chunk * chunkSize;
+			func(begin, std::min(begin + chunkSize, count));
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < numWorkers; i++)
+		threads.push_back(std::thread(worker));
+	worker();
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+}
+
+}
+
+#endif // PARALLEL_H
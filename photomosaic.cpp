@@ -8,28 +8,65 @@
  * @date Fall 2011
  */
 
+#include <algorithm>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
 #include <set>
+#include <thread>
 #include <vector>
 
 #include "png.h"
 #include "maptiles.h"
 #include "mosaiccanvas.h"
+#include "parallel.h"
 #include "sourceimage.h"
+#include "tileatlas.h"
+#include "tileindex.h"
+#include "tilelibrary.h"
 #include "util.h"
 
 using namespace std;
 using namespace util;
 
 void makePhotoMosaic(const string & inFile, const string & tileDir, int numTiles, int pixelsPerTile, const string & outFile);
-vector<TileImage> getTiles(string tileDir);
+vector<string> getImageFiles(string tileDir);
+vector<TileImage> getTiles(string tileDir, int numThreads, bool useIndex, int thumbnailResolution);
+template <typename Consumer>
+void decodeTiles(const vector<string> & imageFiles, int numThreads, int thumbnailResolution, Consumer consume);
 bool hasImageExtension(const string & fileName);
 
 namespace opts
 {
 	bool help = false;
+	bool index = true;
+	bool thumbnails = false;
+	bool atlas = false;
+	bool library = false;
 }
 
+/**
+ * Name of the tile index file kept in the tile directory.
+ */
+const string tileIndexName = ".mosaic_tile_index";
+
+/**
+ * Prefix of the name of the tile library files kept in the tile directory,
+ * which end in the resolution their tiles are scaled to.
+ */
+const string tileLibraryPrefix = ".mosaic_tile_library_";
+
+/**
+ * Prefix of the name of the files that keep the tile chosen for each region
+ * color with a tile library, which end in the library's resolution.
+ */
+const string tileLookupPrefix = ".mosaic_tile_lookup_";
+
+/**
+ * Tile images smaller than this in either dimension are skipped.
+ */
+const size_t minTileResolution = 8;
+
 int main(int argc, const char** argv)
 {
 	string inFile = "";
@@ -46,17 +83,21 @@ int main(int argc, const char** argv)
 	optsparse.addArg(outFile);
 	optsparse.addOption("help", opts::help);
 	optsparse.addOption("h", opts::help);
+	optsparse.addOption("index", opts::index);
+	optsparse.addOption("thumbnails", opts::thumbnails);
+	optsparse.addOption("atlas", opts::atlas);
+	optsparse.addOption("library", opts::library);
 	optsparse.parse(argc, argv);
 	
 	if (opts::help)
 	{
-		cout << "Usage: " << argv[0] << " background_image.png tile_directory/ [number of tiles] [pixels per tile] [output_image.png]" << endl;
+		cout << "Usage: " << argv[0] << " background_image.png tile_directory/ [number of tiles] [pixels per tile] [output_image.png] [--noindex] [--thumbnails] [--atlas] [--library]" << endl;
 		return 0;
 	}
 
 	if (inFile == "")
 	{
-		cout << "Usage: " << argv[0] << " background_image.png tile_directory/ [number of tiles] [pixels per tile] [output_image.png]" << endl;
+		cout << "Usage: " << argv[0] << " background_image.png tile_directory/ [number of tiles] [pixels per tile] [output_image.png] [--noindex] [--thumbnails] [--atlas] [--library]" << endl;
 		return 1;
 	}
 
@@ -69,16 +110,69 @@ void makePhotoMosaic(const string & inFile, const string & tileDir, int numTiles
 {
 	PNG inImage(inFile);
 	SourceImage source(inImage, numTiles);
-	vector<TileImage> tiles = getTiles(tileDir);
+	// With --thumbnails, tiles only keep thumbnails up to the next power of
+	// two at least as large as they are drawn
+	int thumbnailResolution = 0;
+	if (opts::thumbnails)
+		for (thumbnailResolution = 1; thumbnailResolution < pixelsPerTile; thumbnailResolution *= 2);
 
-	if (tiles.empty())
+	// With --library, the tiles' colors, KDTree and atlas are mapped in from
+	// a library file built on an earlier run with the same tile files, and
+	// no tile is decoded at all
+	vector<TileImage> tiles;
+	TileLibrary library;
+	bool haveLibrary = false;
+	string libraryDir = tileDir + (tileDir[tileDir.length()-1] == '/' ? "" : "/");
+	if (opts::library)
+	{
+		vector<string> imageFiles = getImageFiles(tileDir);
+		uint64_t fingerprint = TileLibrary::fingerprint(imageFiles, pixelsPerTile);
+		string libraryFile = libraryDir + tileLibraryPrefix + to_string(pixelsPerTile);
+		haveLibrary = library.readFromFile(libraryFile, fingerprint);
+		if (haveLibrary)
+			cerr << "Mapped tile library " << libraryFile << " (" << library.getTiles()->size() << " tiles)" << endl;
+		else
+		{
+			tiles = getTiles(tileDir, hardwareThreads(), opts::index, thumbnailResolution);
+			cerr << "Building tile library " << libraryFile << "... ";
+			library = TileLibrary(tiles, pixelsPerTile, fingerprint, hardwareThreads());
+			haveLibrary = true;
+			if (library.writeToFile(libraryFile))
+				cerr << "Done" << endl;
+			else
+				cerr << endl << "Warning: could not write tile library " << libraryFile << endl;
+		}
+	}
+	else
+		tiles = getTiles(tileDir, hardwareThreads(), opts::index, thumbnailResolution);
+
+	if (haveLibrary ? library.getTiles()->empty() : tiles.empty())
 	{
 		cerr << "ERROR: No tile images found in " << tileDir << endl;
 		exit(2);
 	}
 
 	MosaicCanvas::enableOutput = true;
-	MosaicCanvas * mosaic = mapTiles(source, tiles);
+	MosaicCanvas * mosaic;
+	if (haveLibrary)
+	{
+		// The tiles chosen for region colors on earlier runs with the same
+		// library are reused, and the ones chosen on this run are kept
+		TileLookupTable lookupTable;
+		string lookupFile = libraryDir + tileLookupPrefix + to_string(pixelsPerTile);
+		lookupTable.readFromFile(lookupFile, library.getFingerprint(), library.getTiles()->size());
+		size_t knownColors = lookupTable.size();
+
+		mosaic = mapTiles(source, library.getTiles(), library.getTileColors(), library.getNodeTiles(),
+				hardwareThreads(), &lookupTable);
+		if (mosaic != NULL)
+			mosaic->setAtlas(library.getAtlas());
+
+		if (lookupTable.size() != knownColors && !lookupTable.writeToFile(lookupFile, library.getFingerprint()))
+			cerr << "Warning: could not write tile lookup table " << lookupFile << endl;
+	}
+	else
+		mosaic = mapTiles(source, tiles, hardwareThreads());
 	cerr << endl;
 
 	if (mosaic == NULL)
@@ -87,16 +181,37 @@ void makePhotoMosaic(const string & inFile, const string & tileDir, int numTiles
 		exit(3);
 	}
 
-	PNG result = mosaic->drawMosaic(pixelsPerTile);
-	cerr << "Saving Output Image... ";
-	result.writeToFile(outFile);
-	cerr << "Done" << endl;
+	// With --atlas, each tile the mosaic uses is scaled once up front and
+	// packed into one arena that the mosaic is copied from. Tiles it does not
+	// use are left out, so tiles taken from the index are never decoded
+	if (opts::atlas && !haveLibrary)
+	{
+		vector<size_t> usedTiles = mosaic->getUsedTiles();
+		cerr << "Packing " << usedTiles.size() << " tiles into an atlas... ";
+		mosaic->setAtlas(make_shared<const TileAtlas>(TileAtlas::fromTiles(tiles, usedTiles, pixelsPerTile, hardwareThreads())));
+		cerr << "Done" << endl;
+	}
+
+	// Mosaics are made of flat runs and repeated rows, which the Sub and Up
+	// filters alone compress as well as libpng's adaptive choice of all five,
+	// in about half the time
+	PNGWriteOptions writeOptions;
+	writeOptions.filters = PNG_FILTER_SUB | PNG_FILTER_UP;
+	writeOptions.numThreads = hardwareThreads();
+	bool written = mosaic->writeMosaic(outFile, pixelsPerTile, hardwareThreads(), writeOptions);
 	delete mosaic;
+	if (!written)
+	{
+		cerr << "ERROR: Could not write " << outFile << endl;
+		exit(4);
+	}
 }
 
-vector<TileImage> getTiles(string tileDir)
+/**
+ * Lists the image files in a tile directory, in sorted order.
+ */
+vector<string> getImageFiles(string tileDir)
 {
-#if 1
 	if (tileDir[tileDir.length()-1] != '/')
 		tileDir += '/';
 
@@ -108,24 +223,123 @@ vector<TileImage> getTiles(string tileDir)
 	for (size_t i = 0; i < allFiles.size(); i++)
 		if (hasImageExtension(allFiles[i]))
 			imageFiles.push_back(allFiles[i]);
+	return imageFiles;
+}
+
+vector<TileImage> getTiles(string tileDir, int numThreads, bool useIndex, int thumbnailResolution)
+{
+#if 1
+	if (tileDir[tileDir.length()-1] != '/')
+		tileDir += '/';
+
+	vector<string> imageFiles = getImageFiles(tileDir);
+
+	// Tiles whose files have not changed since they were last indexed are
+	// taken from the index, and only decoded later if they are drawn
+	TileIndex oldIndex;
+	TileIndex newIndex;
+	string indexFile = tileDir + tileIndexName;
+	if (useIndex)
+		oldIndex.readFromFile(indexFile);
+
+	vector<TileIndex::Entry> entries(imageFiles.size());
+	vector<bool> canStat(imageFiles.size(), false);
+	vector<bool> upToDate(imageFiles.size(), false);
+	vector<string> changedFiles;
+	vector<size_t> changedIndices;
+	vector<bool> skipped(imageFiles.size(), false);
+	size_t numNotPNG = 0;
+	size_t numTooSmall = 0;
+	for (size_t i = 0; i < imageFiles.size(); i++)
+	{
+		TileIndex::Entry & entry = entries[i];
+		canStat[i] = TileIndex::statFile(imageFiles[i], entry.fileSize, entry.modifiedTime);
+		upToDate[i] = canStat[i] && oldIndex.lookup(imageFiles[i], entry.fileSize, entry.modifiedTime, entry);
+		if (upToDate[i])
+		{
+			newIndex.update(imageFiles[i], entry);
+			continue;
+		}
+
+		// Only the header of a changed file is read before deciding whether
+		// to decode it, so files that could never become tiles cost one
+		// small read rather than a full decode
+		PNGHeader header;
+		if (!PNG::readHeader(imageFiles[i], header))
+		{
+			skipped[i] = true;
+			numNotPNG++;
+		}
+		else if (min(header.width, header.height) < minTileResolution)
+		{
+			skipped[i] = true;
+			numTooSmall++;
+		}
+		else
+		{
+			changedFiles.push_back(imageFiles[i]);
+			changedIndices.push_back(i);
+		}
+	}
 
 	vector<TileImage> images;
+	images.reserve(imageFiles.size());
 	set<RGBAPixel> avgColors;
-	for (size_t i = 0; i < imageFiles.size(); i++)
+	auto addTile = [&](size_t i, TileImage next)
 	{
 		cerr << "\rLoading Tile Images... (" << (i + 1) << "/" << imageFiles.size() << ")" << string(20, ' ') << "\r";
 		cerr.flush();
-		TileImage next(PNG(imageFiles.at(i)));
 		if (avgColors.count(next.getAverageColor()) == 0)
 		{
 			avgColors.insert(next.getAverageColor());
-			images.push_back(next);
+			images.push_back(move(next));
 		}
-	}
+	};
+
+	// Tiles are added in file order, so indexed tiles before each decoded
+	// tile are added first
+	size_t nextFile = 0;
+	auto addIndexedTiles = [&](size_t end)
+	{
+		for (; nextFile < end; nextFile++)
+			if (!skipped[nextFile])
+				addTile(nextFile, TileImage(imageFiles[nextFile], entries[nextFile].averageColor,
+							entries[nextFile].resolution, thumbnailResolution));
+	};
+
+	decodeTiles(changedFiles, numThreads, thumbnailResolution, [&](size_t k, TileImage next)
+	{
+		size_t i = changedIndices[k];
+		addIndexedTiles(i);
+		nextFile = i + 1;
+
+		if (canStat[i])
+		{
+			entries[i].resolution = next.getResolution();
+			entries[i].averageColor = next.getAverageColor();
+			newIndex.update(imageFiles[i], entries[i]);
+		}
+		addTile(i, move(next));
+	});
+	addIndexedTiles(imageFiles.size());
+
 	cerr << "\rLoading Tile Images... (" << imageFiles.size() << "/" << imageFiles.size() << ")";
-	cerr << "... " << images.size() << " unique images loaded" << endl;
+	cerr << "... " << images.size() << " unique images loaded";
+	if (useIndex)
+		cerr << " (" << changedFiles.size() << " decoded)";
+	cerr << endl;
+	if (numNotPNG + numTooSmall > 0)
+	{
+		cerr << "Skipped " << (numNotPNG + numTooSmall) << " files without decoding them: "
+		     << numNotPNG << " not valid PNGs, " << numTooSmall << " smaller than "
+		     << minTileResolution << "x" << minTileResolution << endl;
+	}
 	cerr.flush();
 
+	if (useIndex && (!changedFiles.empty() || newIndex.size() != oldIndex.size()))
+		if (!newIndex.writeToFile(indexFile))
+			cerr << "Warning: could not write tile index " << indexFile << endl;
+
 	return images;
 #else
 	PNG temp;
@@ -147,6 +361,78 @@ vector<TileImage> getTiles(string tileDir)
 #endif
 }
 
+/**
+ * Decodes each of the given image files into a TileImage on up to numThreads
+ * threads, and calls consume(i, tile) for each one in the same order as
+ * imageFiles, on the calling thread. Workers only run a bounded distance
+ * ahead of the consumer, so few decoded tiles are waiting at any time.
+ * Tiles keep only thumbnails if thumbnailResolution is not 0.
+ */
+template <typename Consumer>
+void decodeTiles(const vector<string> & imageFiles, int numThreads, int thumbnailResolution, Consumer consume)
+{
+	if (numThreads <= 1)
+	{
+		for (size_t i = 0; i < imageFiles.size(); i++)
+			consume(i, TileImage(PNG(imageFiles.at(i)), thumbnailResolution));
+		return;
+	}
+
+	// Tile i is decoded into slots[i % window], which is free once tile
+	// i - window has been consumed
+	const size_t window = 4 * numThreads;
+	vector<TileImage> slots(window);
+	vector<bool> ready(window, false);
+	size_t nextToDecode = 0;
+	size_t nextToConsume = 0;
+	mutex slotsMutex;
+	condition_variable tileDecoded;
+	condition_variable tileConsumed;
+
+	auto worker = [&]()
+	{
+		unique_lock<mutex> lock(slotsMutex);
+		while (true)
+		{
+			tileConsumed.wait(lock, [&]() {
+				return nextToDecode >= imageFiles.size() || nextToDecode < nextToConsume + window;
+			});
+			if (nextToDecode >= imageFiles.size())
+				return;
+			size_t i = nextToDecode++;
+
+			lock.unlock();
+			TileImage tile = TileImage(PNG(imageFiles.at(i)), thumbnailResolution);
+			lock.lock();
+
+			slots[i % window] = move(tile);
+			ready[i % window] = true;
+			tileDecoded.notify_all();
+		}
+	};
+
+	vector<thread> workers;
+	for (int t = 0; t < numThreads; t++)
+		workers.push_back(thread(worker));
+
+	for (size_t i = 0; i < imageFiles.size(); i++)
+	{
+		TileImage next;
+		{
+			unique_lock<mutex> lock(slotsMutex);
+			tileDecoded.wait(lock, [&]() { return ready[i % window]; });
+			next = move(slots[i % window]);
+			ready[i % window] = false;
+			nextToConsume++;
+		}
+		tileConsumed.notify_all();
+		consume(i, move(next));
+	}
+
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+}
+
 bool hasImageExtension(const string & fileName)
 {
 	size_t dotpos = fileName.find_last_of(".");
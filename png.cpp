@@ -8,12 +8,23 @@
  * @date Modified: Summer 2012
  */
 
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
+#include <type_traits>
 
 #include "png.h"
+#include "parallel.h"
 
 using std::uint8_t;
 
+// Rows of RGBAPixels are compared, copied and handed to libpng as 8 bit
+// RGBA bytes
+static_assert(sizeof(RGBAPixel) == 4, "RGBAPixel must be laid out as packed RGBA bytes");
+
+// vector<PNG> only moves its images when it grows if moving cannot throw
+static_assert(std::is_nothrow_move_constructible<PNG>::value, "PNG must be nothrow move constructible");
+
 inline void epng_err(string const & err)
 {
 	cerr << "[EasyPNG]: " << err << endl;
@@ -35,13 +46,7 @@ void PNG::_copy(PNG const & other)
 	_width = other._width;
 	_height = other._height;
 	_pixels = new RGBAPixel[_height * _width];
-	for (size_t y = 0; y < _height; y++)
-	{
-		for (size_t x = 0; x < _width; x++)
-		{
-			_pixel(x,y) = other._pixel(x,y);
-		}
-	}
+	std::copy(other._pixels, other._pixels + _height * _width, _pixels);
 }
 
 void PNG::_blank()
@@ -139,6 +144,14 @@ PNG::PNG(PNG const & other)
 	_copy(other);
 }
 
+PNG::PNG(PNG && other) noexcept
+	: _width(other._width), _height(other._height), _pixels(other._pixels)
+{
+	other._width = 0;
+	other._height = 0;
+	other._pixels = NULL;
+}
+
 PNG::~PNG()
 {
 	_clear();
@@ -154,6 +167,15 @@ PNG const & PNG::operator=(PNG const & other)
 	return *this;
 }
 
+PNG const & PNG::operator=(PNG && other) noexcept
+{
+	// other frees our old pixels when it is destroyed
+	std::swap(_width, other._width);
+	std::swap(_height, other._height);
+	std::swap(_pixels, other._pixels);
+	return *this;
+}
+
 bool PNG::_pixels_same( const RGBAPixel & first, const RGBAPixel & second ) const {
     return first.red == second.red && first.green == second.green && first.blue == second.blue && first.alpha == second.alpha;
 }
@@ -162,15 +184,9 @@ bool PNG::operator==(PNG const & other) const
 {
 	if (_width != other._width || _height != other._height)
 		return false;
-	for (size_t y = 0; y < _height; y++)
-	{
-		for (size_t x = 0; x < _width; x++)
-		{
-            if( !_pixels_same( _pixel( x, y ), other._pixel( x, y ) ) )
-				return false;
-		}
-	}
-	return true;
+	// Pixels have no padding, so comparing their bytes compares all four
+	// channels, as _pixels_same does
+	return memcmp(_pixels, other._pixels, _height * _width * sizeof(RGBAPixel)) == 0;
 }
 
 bool PNG::operator!=(PNG const & other) const
@@ -196,6 +212,56 @@ bool PNG::readFromFile(string const & file_name)
 	return _read_file(file_name);
 }
 
+bool PNG::readHeader(string const & file_name, PNGHeader & header)
+{
+	// the signature, then the IHDR chunk's length, type, 13 data bytes
+	// and crc, which the png spec requires to come first
+	png_byte bytes[33];
+	FILE * fp = fopen(file_name.c_str(), "rb");
+	if (!fp)
+		return false;
+	size_t read = fread(bytes, 1, sizeof(bytes), fp);
+	fclose(fp);
+	if (read != sizeof(bytes) || png_sig_cmp(bytes, 0, 8))
+		return false;
+
+	png_byte const * chunk = bytes + 8;
+	png_byte const * data = chunk + 8;
+	if (png_get_uint_32(chunk) != 13 || memcmp(chunk + 4, "IHDR", 4) != 0)
+		return false;
+	if (png_get_uint_32(data + 13) != (crc32(0, chunk + 4, 17) & 0xffffffff))
+		return false;
+
+	header.width = png_get_uint_32(data);
+	header.height = png_get_uint_32(data + 4);
+	header.bitDepth = data[8];
+	header.colorType = data[9];
+	header.interlaceType = data[12];
+
+	int depth = header.bitDepth;
+	bool valid_depth;
+	switch (header.colorType)
+	{
+		case PNG_COLOR_TYPE_GRAY:
+			valid_depth = depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16;
+			break;
+		case PNG_COLOR_TYPE_PALETTE:
+			valid_depth = depth == 1 || depth == 2 || depth == 4 || depth == 8;
+			break;
+		case PNG_COLOR_TYPE_RGB:
+		case PNG_COLOR_TYPE_GRAY_ALPHA:
+		case PNG_COLOR_TYPE_RGB_ALPHA:
+			valid_depth = depth == 8 || depth == 16;
+			break;
+		default:
+			valid_depth = false;
+	}
+
+	return valid_depth && header.width > 0 && header.height > 0
+		&& data[10] == PNG_COMPRESSION_TYPE_BASE && data[11] == PNG_FILTER_TYPE_BASE
+		&& (header.interlaceType == PNG_INTERLACE_NONE || header.interlaceType == PNG_INTERLACE_ADAM7);
+}
+
 // TODO: clean up error handling, too much dupe code right now
 bool PNG::_read_file(string const & file_name)
 {
@@ -275,193 +341,533 @@ bool PNG::_read_file(string const & file_name)
 		if (color_type == PNG_COLOR_TYPE_PALETTE)
 			png_set_palette_to_rgb(png_ptr);
 	}
-	// convert tRNS to alpha channel
+	// convert tRNS to alpha channel, or add an opaque alpha channel, so
+	// that every row decodes to 8 bit RGBA
 	if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
 		png_set_tRNS_to_alpha(png_ptr);
+	else if (!(color_type & PNG_COLOR_MASK_ALPHA))
+		png_set_filler(png_ptr, 255, PNG_FILLER_AFTER);
+
+	// deinterlace interlaced images while reading them
+	png_set_interlace_handling(png_ptr);
 
 	_width = png_get_image_width(png_ptr, info_ptr);
 	_height = png_get_image_height(png_ptr, info_ptr);
 
 	png_read_update_info(png_ptr, info_ptr);
 
-	// begin reading in the image
-	if (setjmp(png_jmpbuf(png_ptr)))
+	if (png_get_rowbytes(png_ptr, info_ptr) != _width * sizeof(RGBAPixel))
 	{
-		epng_err("Error reading image with libpng");
+		epng_err("Unsupported PNG pixel format");
 		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 		fclose(fp);
 		_init();
 		return false;
 	}
 
-
-	int bpr = png_get_rowbytes(png_ptr, info_ptr); // number of bytes in a row
-	int numchannels = png_get_channels(png_ptr, info_ptr);
-
-	// initialie our image storage
+	// initialize our image storage; libpng decodes each row straight into
+	// its place in it
 	_pixels = new RGBAPixel[_height * _width];
-	png_byte * row = new png_byte[bpr];
+	png_bytep * rows = new png_bytep[_height];
 	for (size_t y = 0; y < _height; y++)
+		rows[y] = reinterpret_cast<png_bytep>(row(y));
+
+	// begin reading in the image
+	if (setjmp(png_jmpbuf(png_ptr)))
 	{
-		png_read_row(png_ptr, row, NULL);
-		png_byte * pix = row;
-		for (size_t x = 0; x < _width; x++)
-		{
-			RGBAPixel & pixel = _pixel(x,y);
-			if (numchannels == 1 || numchannels == 2)
-			{
-				// monochrome
-				uint8_t color = (uint8_t) *pix++;
-				pixel.red = color;
-				pixel.green = color;
-				pixel.blue = color;
-				if (numchannels == 2)
-					pixel.alpha = (uint8_t) *pix++;
-				else
-					pixel.alpha = 255;
-			} 
-			else if (numchannels == 3 || numchannels == 4) 
-			{
-				pixel.red = (uint8_t) *pix++;
-				pixel.green = (uint8_t) *pix++;
-				pixel.blue = (uint8_t) *pix++;
-				if (numchannels == 4)
-					pixel.alpha = (uint8_t) *pix++;
-				else
-					pixel.alpha = 255;
-			}
-		}
+		epng_err("Error reading image with libpng");
+		delete [] rows;
+		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+		fclose(fp);
+		_init();
+		return false;
 	}
+
+	png_read_image(png_ptr, rows);
+
 	// cleanup
-	delete [] row;
+	delete [] rows;
 	png_read_end(png_ptr, NULL);
 	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 	fclose(fp);
 	return true;
 }
 
-bool PNG::writeToFile(string const & file_name)
+bool PNG::writeToFile(string const & file_name, PNGWriteOptions const & options)
 {
-	FILE * fp = fopen(file_name.c_str(), "wb");
-	if (!fp)
-	{
-		epng_err("Failed to open file " + file_name);
+	PNGWriter writer;
+	bool opaque = options.dropOpaqueAlpha && isOpaque();
+	if (!writer.open(file_name, _width, _height, options, opaque))
 		return false;
+	for (size_t y = 0; y < _height; y++)
+		if (!writer.writeRow(row(y)))
+			return false;
+	return writer.close();
+}
+
+bool PNG::isOpaque() const
+{
+	for (size_t i = 0; i < _width * _height; i++)
+		if (_pixels[i].alpha != 255)
+			return false;
+	return true;
+}
+
+size_t PNG::width() const
+{
+	return _width;
+}
+
+size_t PNG::height() const
+{
+	return _height;
+}
+
+void PNG::resize(size_t width_arg, size_t height_arg)
+{
+	_min_clamp_xy(width_arg, height_arg);
+	if (width_arg == _width && height_arg == _height)
+		return;
+
+	RGBAPixel * arr = _pixels;
+
+	// make a new array if needed
+	// will be all white because of RGBAPixel default constructor
+	bool new_arr = width_arg * height_arg > _width * _height;
+	if (new_arr)
+		arr = new RGBAPixel[width_arg*height_arg];
+
+	// copy over pixels
+	size_t min_width = (width_arg > _width) ? _width : width_arg;
+	size_t min_height = (height_arg > _height) ? _height : height_arg;
+	for (size_t x = 0; x < min_width; x++)
+		for (size_t y = 0; y < min_height; y++)
+			arr[x + y * width_arg] = _pixel(x,y);
+
+	// set new array if needed
+	if (new_arr)
+	{
+		delete [] _pixels;
+		_pixels = arr;
 	}
 
-	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (!png_ptr)
+	// overwrite width and height
+	_width = width_arg;
+	_height = height_arg;
+}
+
+PNGWriter::PNGWriter()
+	: _fp(NULL), _png_ptr(NULL), _info_ptr(NULL), _height(0), _rows_written(0), _striped(false)
+{ /* nothing */ }
+
+PNGWriter::~PNGWriter()
+{
+	if (_fp)
 	{
-		epng_err("Failed to create png struct");
-		fclose(fp);
-		return false;
+		epng_err("Warning: image closed before all rows were written");
+		_destroy();
 	}
+}
 
-	png_infop info_ptr = png_create_info_struct(png_ptr);
-	if (!info_ptr)
+void PNGWriter::_destroy()
+{
+	if (_png_ptr)
+		png_destroy_write_struct(&_png_ptr, _info_ptr ? &_info_ptr : NULL);
+	if (_fp)
+		fclose(_fp);
+	_fp = NULL;
+	_png_ptr = NULL;
+	_info_ptr = NULL;
+	_striped = false;
+	std::vector<png_byte>().swap(_pending);
+}
+
+bool PNGWriter::open(string const & file_name, size_t width_arg, size_t height_arg,
+		PNGWriteOptions const & options, bool opaque)
+{
+	if (_fp)
+		_destroy();
+
+	_fp = fopen(file_name.c_str(), "wb");
+	if (!_fp)
 	{
-		epng_err("Failed to create png info struct");
-		png_destroy_write_struct(&png_ptr, NULL);
-		fclose(fp);
+		epng_err("Failed to open file " + file_name);
 		return false;
 	}
 
-	if (setjmp(png_jmpbuf(png_ptr)))
+	// kept in a member rather than a local so that it survives a longjmp
+	_bytes_per_pixel = opaque && options.dropOpaqueAlpha ? 3 : 4;
+	if (options.numThreads > 1)
+		return _open_striped(width_arg, height_arg, options, _bytes_per_pixel == 3);
+
+	_png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!_png_ptr)
 	{
-		epng_err("Error initializing libpng io");
-		png_destroy_write_struct(&png_ptr, &info_ptr);
-		fclose(fp);
+		epng_err("Failed to create png struct");
+		_destroy();
 		return false;
 	}
 
-	png_init_io(png_ptr, fp);
+	_info_ptr = png_create_info_struct(_png_ptr);
+	if (!_info_ptr)
+	{
+		epng_err("Failed to create png info struct");
+		_destroy();
+		return false;
+	}
 
 	// write header
-	if (setjmp(png_jmpbuf(png_ptr)))
+	if (setjmp(png_jmpbuf(_png_ptr)))
 	{
 		epng_err("Error writing image header");
-		png_destroy_write_struct(&png_ptr, &info_ptr);
-		fclose(fp);
+		_destroy();
 		return false;
 	}
-	png_set_IHDR(png_ptr, info_ptr, _width, _height, 
+
+	png_init_io(_png_ptr, _fp);
+	png_set_IHDR(_png_ptr, _info_ptr, width_arg, height_arg,
 			8,
-			PNG_COLOR_TYPE_RGB_ALPHA, 
-			PNG_INTERLACE_NONE, 
+			_bytes_per_pixel == 3 ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA,
+			PNG_INTERLACE_NONE,
 			PNG_COMPRESSION_TYPE_BASE,
 			PNG_FILTER_TYPE_BASE);
 
-	png_write_info(png_ptr, info_ptr);
+	if (options.compressionLevel >= 0)
+		png_set_compression_level(_png_ptr, options.compressionLevel);
+	if (options.filters >= 0)
+		png_set_filter(_png_ptr, PNG_FILTER_TYPE_BASE, options.filters);
+	if (options.strategy >= 0)
+		png_set_compression_strategy(_png_ptr, options.strategy);
 
-	// write image
-	if (setjmp(png_jmpbuf(png_ptr)))
+	png_write_info(_png_ptr, _info_ptr);
+
+	// rows are still passed in as RGBA; have libpng skip the alpha bytes
+	if (_bytes_per_pixel == 3)
+		png_set_filler(_png_ptr, 0, PNG_FILLER_AFTER);
+
+	_height = height_arg;
+	_rows_written = 0;
+	return true;
+}
+
+bool PNGWriter::writeRow(RGBAPixel const * row)
+{
+	if (!_fp || _rows_written >= _height)
 	{
-		epng_err("Failed to write image");
-		png_destroy_write_struct(&png_ptr, &info_ptr);
-		fclose(fp);
+		epng_err("Failed to write image: no more rows expected");
 		return false;
 	}
 
-	int bpr = png_get_rowbytes(png_ptr, info_ptr);
-	png_byte * row = new png_byte[bpr];
-	for (size_t y = 0; y < _height; y++)
+	if (_striped)
 	{
-		for (size_t x = 0; x < _width; x++)
+		// compress the rows already waiting before starting a new batch
+		if (_pending.size() >= _stripe_rows * _num_threads * _row_bytes && !_write_stripes(false))
+			return false;
+		png_byte const * pixel = reinterpret_cast<png_byte const *>(row);
+		if (_bytes_per_pixel == 4)
+			_pending.insert(_pending.end(), pixel, pixel + _row_bytes);
+		else
 		{
-			png_byte * pix = &(row[x*4]);
-			pix[0] = _pixel(x,y).red;
-			pix[1] = _pixel(x,y).green;
-			pix[2] = _pixel(x,y).blue;
-			pix[3] = _pixel(x,y).alpha;
+			for (size_t x = 0; x < _row_bytes / 3; x++, pixel += 4)
+				_pending.insert(_pending.end(), pixel, pixel + 3);
 		}
-		png_write_row(png_ptr, row);
+		_rows_written++;
+		return true;
 	}
-	delete [] row;
-	png_write_end(png_ptr, NULL);
-	png_destroy_write_struct(&png_ptr, &info_ptr);
-	fclose(fp);
+
+	if (setjmp(png_jmpbuf(_png_ptr)))
+	{
+		epng_err("Failed to write image");
+		_destroy();
+		return false;
+	}
+
+	png_write_row(_png_ptr, reinterpret_cast<png_bytep>(const_cast<RGBAPixel *>(row)));
+	_rows_written++;
 	return true;
 }
 
-size_t PNG::width() const
+bool PNGWriter::close()
 {
-	return _width;
+	if (!_fp || _rows_written != _height)
+	{
+		epng_err("Failed to write image: not all rows were written");
+		_destroy();
+		return false;
+	}
+
+	if (_striped)
+	{
+		static png_byte const no_data = 0;
+		bool written = _write_stripes(true) && _write_chunk("IEND", &no_data, 0);
+		written = fclose(_fp) == 0 && written;
+		_fp = NULL;
+		_destroy();
+		if (!written)
+			epng_err("Failed to write image");
+		return written;
+	}
+
+	if (setjmp(png_jmpbuf(_png_ptr)))
+	{
+		epng_err("Failed to write image");
+		_destroy();
+		return false;
+	}
+
+	png_write_end(_png_ptr, NULL);
+	_destroy();
+	return true;
 }
 
-size_t PNG::height() const
+namespace
 {
-	return _height;
+
+/**
+ * Filters one row of a png image with the given filter type, writing the
+ * filter type byte followed by the filtered bytes to out.
+ */
+void filter_row(int type, png_byte const * row, png_byte const * prior,
+		size_t row_bytes, size_t bpp, png_byte * out)
+{
+	*out++ = type;
+	for (size_t i = 0; i < row_bytes; i++)
+	{
+		int a = i >= bpp ? row[i - bpp] : 0;
+		int b = prior[i];
+		int c = i >= bpp ? prior[i - bpp] : 0;
+		int predictor = 0;
+		switch (type)
+		{
+			case 1: predictor = a; break;
+			case 2: predictor = b; break;
+			case 3: predictor = (a + b) / 2; break;
+			case 4:
+			{
+				int p = a + b - c;
+				int pa = abs(p - a);
+				int pb = abs(p - b);
+				int pc = abs(p - c);
+				predictor = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+				break;
+			}
+		}
+		out[i] = static_cast<png_byte>(row[i] - predictor);
+	}
 }
 
-void PNG::resize(size_t width_arg, size_t height_arg)
+/**
+ * Filters a row with whichever of the allowed filters gives the smallest
+ * sum of absolute (signed) differences, as libpng does.
+ */
+void filter_row_adaptive(int filters, png_byte const * row, png_byte const * prior,
+		size_t row_bytes, size_t bpp, png_byte * out, std::vector<png_byte> & scratch)
 {
-	_min_clamp_xy(width_arg, height_arg);
-	if (width_arg == _width && height_arg == _height)
-		return;
+	static int const flags[5] = { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP,
+		PNG_FILTER_AVG, PNG_FILTER_PAETH };
 
-	RGBAPixel * arr = _pixels;
+	scratch.resize(row_bytes + 1);
+	uint64_t best_sum = UINT64_MAX;
+	for (int type = 0; type < 5; type++)
+	{
+		if (!(filters & flags[type]))
+			continue;
+		if (filters == flags[type])
+		{
+			filter_row(type, row, prior, row_bytes, bpp, out);
+			return;
+		}
 
-	// make a new array if needed
-	// will be all white because of RGBAPixel default constructor
-	bool new_arr = width_arg * height_arg > _width * _height;
-	if (new_arr)
-		arr = new RGBAPixel[width_arg*height_arg];
+		filter_row(type, row, prior, row_bytes, bpp, &scratch[0]);
+		uint64_t sum = 0;
+		for (size_t i = 1; i <= row_bytes; i++)
+			sum += abs(static_cast<int8_t>(scratch[i]));
+		if (sum < best_sum)
+		{
+			best_sum = sum;
+			std::copy(scratch.begin(), scratch.end(), out);
+		}
+	}
+}
 
-	// copy over pixels
-	size_t min_width = (width_arg > _width) ? _width : width_arg;
-	size_t min_height = (height_arg > _height) ? _height : height_arg;
-	for (size_t x = 0; x < min_width; x++)
-		for (size_t y = 0; y < min_height; y++)
-			arr[x + y * width_arg] = _pixel(x,y);
+void put_uint32(png_byte * out, uint32_t value)
+{
+	out[0] = value >> 24;
+	out[1] = value >> 16;
+	out[2] = value >> 8;
+	out[3] = value;
+}
 
-	// set new array if needed
-	if (new_arr)
+}
+
+bool PNGWriter::_write_chunk(char const * type, png_byte const * data, size_t length)
+{
+	png_byte header[8];
+	put_uint32(header, length);
+	memcpy(header + 4, type, 4);
+	uLong crc = crc32(0, header + 4, 4);
+	crc = crc32(crc, data, length);
+	png_byte footer[4];
+	put_uint32(footer, crc);
+
+	return fwrite(header, 1, 8, _fp) == 8
+		&& fwrite(data, 1, length, _fp) == length
+		&& fwrite(footer, 1, 4, _fp) == 4;
+}
+
+bool PNGWriter::_open_striped(size_t width_arg, size_t height_arg, PNGWriteOptions const & options, bool drop_alpha)
+{
+	_striped = true;
+	_num_threads = options.numThreads;
+	_level = options.compressionLevel >= 0 ? options.compressionLevel : Z_DEFAULT_COMPRESSION;
+	_filters = options.filters > 0 ? options.filters : (options.filters == 0 ? PNG_FILTER_NONE : PNG_ALL_FILTERS);
+	// libpng's default strategy
+	_strategy = options.strategy >= 0 ? options.strategy
+		: (_filters == PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED);
+	_bytes_per_pixel = drop_alpha ? 3 : 4;
+	_row_bytes = width_arg * _bytes_per_pixel;
+	// stripes of about a megabyte each, so each is big enough to compress
+	// well on its own
+	_stripe_rows = std::max<size_t>(1, (1 << 20) / _row_bytes);
+	_pending.clear();
+	_pending.reserve(_stripe_rows * _num_threads * _row_bytes);
+	_prior_row.assign(_row_bytes, 0);
+	_dictionary.clear();
+	_adler = adler32(0, NULL, 0);
+	_zlib_header_written = false;
+	_height = height_arg;
+	_rows_written = 0;
+
+	static png_byte const signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	png_byte ihdr[13];
+	put_uint32(ihdr, width_arg);
+	put_uint32(ihdr + 4, height_arg);
+	ihdr[8] = 8;
+	ihdr[9] = drop_alpha ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA;
+	ihdr[10] = PNG_COMPRESSION_TYPE_BASE;
+	ihdr[11] = PNG_FILTER_TYPE_BASE;
+	ihdr[12] = PNG_INTERLACE_NONE;
+	if (fwrite(signature, 1, 8, _fp) != 8 || !_write_chunk("IHDR", ihdr, 13))
 	{
-		delete [] _pixels;
-		_pixels = arr;
+		epng_err("Error writing image header");
+		_destroy();
+		return false;
 	}
+	return true;
+}
 
-	// overwrite width and height
-	_width = width_arg;
-	_height = height_arg;
+/**
+ * Filters and deflates the pending rows as stripes on separate threads,
+ * and writes each stripe as an IDAT chunk. Each stripe is raw deflate
+ * data primed with the 32K of filtered data before it and ended with a
+ * full flush, so the stripes join into one deflate stream (as pigz does);
+ * the last one ends the stream, followed by the Adler-32 of all the
+ * filtered data, combined from the checksums of the stripes.
+ */
+bool PNGWriter::_write_stripes(bool last)
+{
+	size_t const window = 32768;
+	size_t num_rows = _pending.size() / _row_bytes;
+	size_t num_stripes = (num_rows + _stripe_rows - 1) / _stripe_rows;
+	size_t filtered_row_bytes = _row_bytes + 1;
+
+	// the filtered rows follow the end of the previous batch's filtered
+	// data, which primes the first stripe
+	size_t start = _dictionary.size();
+	std::vector<png_byte> filtered(start + num_rows * filtered_row_bytes);
+	std::copy(_dictionary.begin(), _dictionary.end(), filtered.begin());
+
+	std::vector<std::vector<png_byte> > compressed(num_stripes);
+	std::vector<uLong> adlers(num_stripes);
+	std::vector<bool> ok(num_stripes, true);
+	util::forEachChunk(num_stripes, 1, _num_threads, [&](size_t begin, size_t end)
+	{
+		std::vector<png_byte> scratch;
+		for (size_t stripe = begin; stripe < end; stripe++)
+		{
+			size_t first_row = stripe * _stripe_rows;
+			size_t end_row = std::min(first_row + _stripe_rows, num_rows);
+			for (size_t y = first_row; y < end_row; y++)
+			{
+				png_byte const * prior = y == 0 ? &_prior_row[0] : &_pending[(y - 1) * _row_bytes];
+				filter_row_adaptive(_filters, &_pending[y * _row_bytes], prior, _row_bytes,
+						_bytes_per_pixel, &filtered[start + y * filtered_row_bytes], scratch);
+			}
+		}
+	});
+
+	util::forEachChunk(num_stripes, 1, _num_threads, [&](size_t begin, size_t end)
+	{
+		for (size_t stripe = begin; stripe < end; stripe++)
+		{
+			size_t offset = start + stripe * _stripe_rows * filtered_row_bytes;
+			size_t length = std::min(_stripe_rows, num_rows - stripe * _stripe_rows) * filtered_row_bytes;
+			size_t dictionary_length = std::min(offset, window);
+			bool final_stripe = last && stripe + 1 == num_stripes;
+
+			z_stream stream;
+			memset(&stream, 0, sizeof(stream));
+			if (deflateInit2(&stream, _level, Z_DEFLATED, -15, 8, _strategy) != Z_OK)
+			{
+				ok[stripe] = false;
+				continue;
+			}
+			if (dictionary_length > 0)
+				deflateSetDictionary(&stream, &filtered[offset - dictionary_length], dictionary_length);
+
+			std::vector<png_byte> & out = compressed[stripe];
+			out.resize(deflateBound(&stream, length) + 16);
+			stream.next_in = &filtered[offset];
+			stream.avail_in = length;
+			int ret;
+			do
+			{
+				if (stream.total_out == out.size())
+					out.resize(out.size() * 2);
+				stream.next_out = &out[stream.total_out];
+				stream.avail_out = out.size() - stream.total_out;
+				ret = deflate(&stream, final_stripe ? Z_FINISH : Z_FULL_FLUSH);
+			} while (ret == Z_OK && (stream.avail_out == 0 || (final_stripe && ret != Z_STREAM_END)));
+			ok[stripe] = final_stripe ? ret == Z_STREAM_END : ret == Z_OK;
+			out.resize(stream.total_out);
+			deflateEnd(&stream);
+
+			adlers[stripe] = adler32(adler32(0, NULL, 0), &filtered[offset], length);
+		}
+	});
+
+	for (size_t stripe = 0; stripe < num_stripes; stripe++)
+	{
+		if (!ok[stripe])
+			return false;
+
+		std::vector<png_byte> & out = compressed[stripe];
+		size_t length = std::min(_stripe_rows, num_rows - stripe * _stripe_rows) * filtered_row_bytes;
+		_adler = adler32_combine(_adler, adlers[stripe], length);
+
+		if (!_zlib_header_written)
+		{
+			// 32K window, deflate, and the level hint zlib itself would give
+			int level = _level == Z_DEFAULT_COMPRESSION ? 6 : _level;
+			int level_hint = level < 2 ? 0 : (level < 6 ? 1 : (level == 6 ? 2 : 3));
+			png_byte header[2] = { 0x78, static_cast<png_byte>(level_hint << 6) };
+			header[1] += (31 - (header[0] * 256 + header[1]) % 31) % 31;
+			out.insert(out.begin(), header, header + 2);
+			_zlib_header_written = true;
+		}
+		if (last && stripe + 1 == num_stripes)
+		{
+			png_byte checksum[4];
+			put_uint32(checksum, _adler);
+			out.insert(out.end(), checksum, checksum + 4);
+		}
+		if (!_write_chunk("IDAT", &out[0], out.size()))
+			return false;
+	}
+
+	// keep what the next batch needs to carry on from here
+	_prior_row.assign(_pending.end() - _row_bytes, _pending.end());
+	_dictionary.assign(filtered.end() - std::min(filtered.size(), window), filtered.end());
+	_pending.clear();
+	return true;
 }
@@ -15,15 +15,77 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <png.h>
+#include <zlib.h>
 
 // c++ style includes
 #include <string>
 #include <iostream>
 #include <sstream>
+#include <vector>
 
 // local includes
 #include "rgbapixel.h"
 
+class PNGView;
+
+/**
+ * What the IHDR chunk at the start of a png file says about its image.
+ */
+struct PNGHeader
+{
+    size_t width; /**< Width of the image. */
+    size_t height; /**< Height of the image. */
+    int bitDepth; /**< Bits per sample or palette index. */
+    int colorType; /**< One of the PNG_COLOR_TYPE_* values. */
+    int interlaceType; /**< PNG_INTERLACE_NONE or PNG_INTERLACE_ADAM7. */
+};
+
+/**
+ * Settings for how a png file is written. The defaults are libpng's own,
+ * except that opaque images are written without an alpha channel.
+ */
+struct PNGWriteOptions
+{
+    /**
+     * zlib compression level, from 0 (none) through 1 (fastest) to 9
+     * (smallest), or -1 for libpng's default.
+     */
+    int compressionLevel;
+
+    /**
+     * The row filters libpng may choose from, as PNG_FILTER_* flags or'd
+     * together (PNG_FILTER_NONE for none), or -1 for libpng's default.
+     */
+    int filters;
+
+    /**
+     * zlib compression strategy (Z_DEFAULT_STRATEGY, Z_FILTERED,
+     * Z_HUFFMAN_ONLY, Z_RLE or Z_FIXED), or -1 for libpng's default.
+     */
+    int strategy;
+
+    /**
+     * Whether to write RGB rather than RGBA when every pixel is opaque.
+     * Reading the file back gives the same pixels either way.
+     */
+    bool dropOpaqueAlpha;
+
+    /**
+     * Number of threads to filter and compress with. With more than one,
+     * horizontal stripes of rows are deflated independently on separate
+     * threads and joined into a single zlib stream.
+     */
+    int numThreads;
+
+    /**
+     * Creates the default options.
+     */
+    PNGWriteOptions()
+        : compressionLevel(-1), filters(-1), strategy(-1), dropOpaqueAlpha(true),
+          numThreads(1)
+    { /* nothing */ }
+};
+
 using std::cerr;
 using std::endl;
 using std::string;
@@ -61,6 +123,15 @@ class PNG
          */
         PNG(PNG const & other);
 
+        /**
+         * Move constructor: creates a new PNG image that takes over the
+         * pixels of another without copying them. The other image is left
+         * empty (0x0) and may only be assigned to or destroyed. It never
+         * throws, so containers of PNGs move them instead of copying.
+         * @param other PNG to be moved from.
+         */
+        PNG(PNG && other) noexcept;
+
         /**
          * Destructor: frees all memory associated with a given PNG object.
          * Invoked by the system.
@@ -74,6 +145,14 @@ class PNG
          */
         PNG const & operator=(PNG const & other);
 
+        /**
+         * Move assignment operator: takes over the pixels of another image
+         * without copying them.
+         * @param other Image to move into the current image.
+         * @return The current image for assignment chaining.
+         */
+        PNG const & operator=(PNG && other) noexcept;
+
         /**
          * Equality operator: checks if two images are the same.
          * @param other Image to be checked.
@@ -109,6 +188,41 @@ class PNG
          */
         RGBAPixel const * operator()(size_t x, size_t y) const;
 
+        /**
+         * Gets a pointer to the first pixel of a row of the image. The
+         * width() pixels of a row are contiguous, left to right. Unlike
+         * operator(), y is not checked or clamped: it must be less than
+         * height().
+         * @param y Y-coordinate of the row.
+         * @return A pointer to the leftmost pixel of the row.
+         */
+        RGBAPixel * row(size_t y);
+
+        /**
+         * Const version of row(). Does not allow the image to be changed
+         * via the pointer.
+         * @param y Y-coordinate of the row.
+         * @return A pointer to the leftmost pixel of the row.
+         */
+        RGBAPixel const * row(size_t y) const;
+
+        /**
+         * Gets a read-only view of the whole image.
+         * @return A view of the image.
+         */
+        PNGView view() const;
+
+        /**
+         * Gets a read-only view of a rectangle of the image. The rectangle
+         * is not checked: it must lie within the image.
+         * @param x X-coordinate of the upper left corner of the rectangle.
+         * @param y Y-coordinate of the upper left corner of the rectangle.
+         * @param width Width of the rectangle.
+         * @param height Height of the rectangle.
+         * @return A view of the rectangle.
+         */
+        PNGView view(size_t x, size_t y, size_t width, size_t height) const;
+
         /**
          * Reads in a PNG image from a file.
          * Overwrites any current image content in the PNG. In the event of
@@ -118,12 +232,30 @@ class PNG
          */
         bool readFromFile(string const & file_name);
 
+        /**
+         * Reads just the signature and header of a png file, without
+         * decoding the image. Nothing is printed if the file is not a
+         * png file.
+         * @param file_name Name of the file to be read from.
+         * @param header Set to what the file's header says.
+         * @return Whether the file starts with a valid png signature and
+         *  a valid IHDR chunk.
+         */
+        static bool readHeader(string const & file_name, PNGHeader & header);
+
         /**
          * Writes a PNG image to a file.
          * @param file_name Name of the file to write to.
+         * @param options How to compress the file.
          * @return Whether the file was written successfully or not.
          */
-        bool writeToFile(string const & file_name);
+        bool writeToFile(string const & file_name, PNGWriteOptions const & options = PNGWriteOptions());
+
+        /**
+         * Checks whether every pixel of the image is fully opaque.
+         * @return Whether every pixel has an alpha of 255.
+         */
+        bool isOpaque() const;
 
         /**
          * Gets the width of this image.
@@ -166,4 +298,157 @@ class PNG
         RGBAPixel & _pixel(size_t x, size_t y) const;
 };
 
+/**
+ * A read-only view of a rectangle of pixels in a PNG, for loops that walk
+ * whole rows without checking every pixel access. A view does not own its
+ * pixels: it is only valid until the image it was taken from is changed,
+ * resized or destroyed.
+ */
+class PNGView
+{
+    public:
+        /**
+         * Creates a view of height rows of width pixels each, where
+         * consecutive rows start stride pixels apart.
+         * @param pixels Pointer to the upper left pixel of the view.
+         * @param width Width of the view.
+         * @param height Height of the view.
+         * @param stride Distance between the starts of consecutive rows.
+         */
+        PNGView(RGBAPixel const * pixels, size_t width, size_t height, size_t stride)
+            : _pixels(pixels), _width(width), _height(height), _stride(stride)
+        { /* nothing */ }
+
+        /**
+         * Gets a pointer to the first pixel of a row of the view. The row
+         * is not checked: y must be less than height().
+         * @param y Y-coordinate of the row, relative to the view.
+         * @return A pointer to the leftmost pixel of the row.
+         */
+        RGBAPixel const * row(size_t y) const
+        {
+            return _pixels + _stride * y;
+        }
+
+        /**
+         * Gets the width of this view.
+         * @return Width of the view.
+         */
+        size_t width() const
+        {
+            return _width;
+        }
+
+        /**
+         * Gets the height of this view.
+         * @return Height of the view.
+         */
+        size_t height() const
+        {
+            return _height;
+        }
+
+    private:
+        RGBAPixel const * _pixels;
+        size_t _width;
+        size_t _height;
+        size_t _stride;
+};
+
+inline RGBAPixel * PNG::row(size_t y)
+{
+    return _pixels + _width * y;
+}
+
+inline RGBAPixel const * PNG::row(size_t y) const
+{
+    return _pixels + _width * y;
+}
+
+inline PNGView PNG::view() const
+{
+    return PNGView(_pixels, _width, _height, _width);
+}
+
+inline PNGView PNG::view(size_t x, size_t y, size_t width_arg, size_t height_arg) const
+{
+    return PNGView(_pixels + _width * y + x, width_arg, height_arg, _width);
+}
+
+/**
+ * Writes a png image to a file one row at a time, so that an image can
+ * be saved without ever holding all of its pixels in memory.
+ */
+class PNGWriter
+{
+    public:
+        /**
+         * Creates a writer with no file open.
+         */
+        PNGWriter();
+
+        /**
+         * Destructor: closes the file if it is still open.
+         */
+        ~PNGWriter();
+
+        /**
+         * Opens a file and writes the header for an image of the given
+         * dimensions. Any file already open is closed first.
+         * @param file_name Name of the file to write to.
+         * @param width Width of the image.
+         * @param height Height of the image.
+         * @param options How to compress the file.
+         * @param opaque Whether every pixel that will be written is fully
+         *  opaque. The alpha channel is only dropped if it is, and if
+         *  options.dropOpaqueAlpha is set.
+         * @return Whether the file was opened successfully or not.
+         */
+        bool open(string const & file_name, size_t width, size_t height,
+                PNGWriteOptions const & options = PNGWriteOptions(), bool opaque = false);
+
+        /**
+         * Writes the next row of the image.
+         * @param row Pointer to the width pixels of the row, left to right.
+         * @return Whether the row was written successfully or not.
+         */
+        bool writeRow(RGBAPixel const * row);
+
+        /**
+         * Finishes the image and closes the file. Every row of the image
+         * must have been written.
+         * @return Whether the image was written successfully or not.
+         */
+        bool close();
+
+    private:
+        FILE * _fp;
+        png_structp _png_ptr;
+        png_infop _info_ptr;
+        size_t _height;
+        size_t _rows_written;
+
+        // state for writing stripes on several threads without libpng
+        bool _striped;
+        int _num_threads;
+        int _level;
+        int _strategy;
+        int _filters;
+        size_t _bytes_per_pixel;
+        size_t _row_bytes;
+        size_t _stripe_rows;
+        std::vector<png_byte> _pending;     // unfiltered rows not yet written
+        std::vector<png_byte> _prior_row;   // last row written, for filtering
+        std::vector<png_byte> _dictionary;  // last 32K of filtered data written
+        uLong _adler;
+        bool _zlib_header_written;
+
+        PNGWriter(PNGWriter const & other);
+        PNGWriter const & operator=(PNGWriter const & other);
+        void _destroy();
+        bool _open_striped(size_t width, size_t height, PNGWriteOptions const & options, bool drop_alpha);
+        bool _write_stripes(bool last);
+        bool _write_chunk(char const * type, png_byte const * data, size_t length);
+};
+
 #endif // EPNG_H
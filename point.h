@@ -85,7 +85,7 @@ class Point
 		bool operator>=(const Point<Dim> p) const;
 
 		void set(int index, double val);
-		bool is_mine() { return am_mine; }
+		bool is_mine() const { return am_mine; }
 
 		void print(std::ostream & out = std::cout) const;
 };
@@ -24,8 +24,10 @@
 
 using namespace std;
 
+const uint64_t SourceImage::maxTableRegion;
+
 SourceImage::SourceImage(const PNG & image, int setResolution)
-	: backingImage(image), resolution(setResolution)
+	: width(image.width()), height(image.height()), resolution(setResolution)
 {
 	if (resolution< 1)
 	{
@@ -33,36 +35,100 @@ SourceImage::SourceImage(const PNG & image, int setResolution)
 		exit(-1);
 	}
 	
-	resolution = min(backingImage.width(), backingImage.height());
+	resolution = min(width, height);
 	resolution = min(resolution, setResolution);
-}
 
-RGBAPixel SourceImage::getRegionColor(int row, int col) const
-{
-	int width  = backingImage.width();
-	int height = backingImage.height();
+	// Regions larger than the table can sum exactly are so large that
+	// there are only a few of them, so average those directly instead
+	uint64_t largestWidth = 0;
+	uint64_t largestHeight = 0;
+	for (int col = 0; col < getColumns(); col++)
+		largestWidth = max(largestWidth, divide(width * (col+1), getColumns()) - divide(width * col, getColumns()));
+	for (int row = 0; row < getRows(); row++)
+		largestHeight = max(largestHeight, divide(height * (row+1), getRows()) - divide(height * row, getRows()));
+
+	if (largestWidth * largestHeight > maxTableRegion)
+	{
+		regionColors.resize(getRows() * getColumns());
+		for (int row = 0; row < getRows(); row++)
+		{
+			for (int col = 0; col < getColumns(); col++)
+			{
+				int startX, endX, startY, endY;
+				getRegionBounds(row, col, startX, endX, startY, endY);
+				uint64_t r = 0;
+				uint64_t g = 0;
+				uint64_t b = 0;
+				for (int y = startY; y < endY; y++)
+				{
+					const RGBAPixel * pixel = image.row(y);
+					for (int x = startX; x < endX; x++)
+					{
+						r += pixel[x].red;
+						g += pixel[x].green;
+						b += pixel[x].blue;
+					}
+				}
 
-	int startX = divide(width  *  col,    getColumns());
-	int endX   = divide(width  * (col+1), getColumns());
-	int startY = divide(height *  row,    getRows());
-	int endY   = divide(height * (row+1), getRows());
+				RGBAPixel & color = regionColors[row * getColumns() + col];
+				uint64_t numPixels = static_cast<uint64_t>(endX - startX) * (endY - startY);
+				color.red   = divide(r, numPixels);
+				color.green = divide(g, numPixels);
+				color.blue  = divide(b, numPixels);
+			}
+		}
+		return;
+	}
 
-	uint64_t r = 0;
-	uint64_t g = 0;
-	uint64_t b = 0;
+	// Build the summed-area table one row at a time: each entry is the
+	// running total of its row so far plus the entry directly above it.
+	// Both wrap around at 2^32
+	sums.resize((width + 1) * (height + 1));
+	for (int x = 0; x <= width; x++)
+		sums[x].red = sums[x].green = sums[x].blue = 0;
 
-	for (int y = startY; y < endY; y++)
+	for (int y = 0; y < height; y++)
 	{
-		for (int x = startX; x < endX; x++)
+		ColorSum * above = &sums[y * (width + 1)];
+		ColorSum * curr  = above + (width + 1);
+		const RGBAPixel * pixel = image.row(y);
+		uint32_t r = 0;
+		uint32_t g = 0;
+		uint32_t b = 0;
+
+		curr[0].red = curr[0].green = curr[0].blue = 0;
+		for (int x = 0; x < width; x++)
 		{
-			r += backingImage(x, y)->red;
-			g += backingImage(x, y)->green;
-			b += backingImage(x, y)->blue;
+			r += pixel[x].red;
+			g += pixel[x].green;
+			b += pixel[x].blue;
+			curr[x+1].red   = above[x+1].red   + r;
+			curr[x+1].green = above[x+1].green + g;
+			curr[x+1].blue  = above[x+1].blue  + b;
 		}
 	}
+}
+
+RGBAPixel SourceImage::getRegionColor(int row, int col) const
+{
+	if (!regionColors.empty())
+		return regionColors[row * getColumns() + col];
+
+	int startX, endX, startY, endY;
+	getRegionBounds(row, col, startX, endX, startY, endY);
+
+	const ColorSum & topLeft     = sumAt(startX, startY);
+	const ColorSum & topRight    = sumAt(endX,   startY);
+	const ColorSum & bottomLeft  = sumAt(startX, endY);
+	const ColorSum & bottomRight = sumAt(endX,   endY);
+
+	// Unsigned arithmetic wraps, so this is exact even if the sums did
+	uint32_t r = bottomRight.red   - bottomLeft.red   - topRight.red   + topLeft.red;
+	uint32_t g = bottomRight.green - bottomLeft.green - topRight.green + topLeft.green;
+	uint32_t b = bottomRight.blue  - bottomLeft.blue  - topRight.blue  + topLeft.blue;
 
 	RGBAPixel color;
-	uint64_t numPixels = (endX - startX) * (endY - startY);
+	uint64_t numPixels = static_cast<uint64_t>(endX - startX) * (endY - startY);
 	color.red   = divide(r, numPixels);
 	color.green = divide(g, numPixels);
 	color.blue  = divide(b, numPixels);
@@ -71,18 +137,31 @@ RGBAPixel SourceImage::getRegionColor(int row, int col) const
 
 int SourceImage::getRows() const
 {
-	if (backingImage.height() <= backingImage.width())
+	if (height <= width)
 		return resolution;
 	else
-		return divide(resolution*backingImage.height(), backingImage.width());
+		return divide(resolution*height, width);
 }
 
 int SourceImage::getColumns() const
 {
-	if (backingImage.width() <= backingImage.height())
+	if (width <= height)
 		return resolution;
 	else
-		return divide(resolution*backingImage.width(), backingImage.height());
+		return divide(resolution*width, height);
+}
+
+const SourceImage::ColorSum & SourceImage::sumAt(int x, int y) const
+{
+	return sums[y * (width + 1) + x];
+}
+
+void SourceImage::getRegionBounds(int row, int col, int & startX, int & endX, int & startY, int & endY) const
+{
+	startX = divide(width  *  col,    getColumns());
+	endX   = divide(width  * (col+1), getColumns());
+	startY = divide(height *  row,    getRows());
+	endY   = divide(height * (row+1), getRows());
 }
 
 uint64_t SourceImage::divide(uint64_t a, uint64_t b)
@@ -15,6 +15,7 @@
 #define _SOURCEIMAGE_H
 
 #include <stdint.h>
+#include <vector>
 #include "png.h"
 
 using namespace std;
@@ -69,9 +70,42 @@ class SourceImage
         int getColumns() const;
 
     private:
-        PNG backingImage;
+        /**
+         * Running color totals for the summed-area table. The entry for
+         * (x, y) holds the sums over all pixels in [0, x) x [0, y), modulo
+         * 2^32. The sums over a region are still exact as long as they fit
+         * in 32 bits, which they do for regions of at most maxTableRegion
+         * pixels.
+         */
+        struct ColorSum
+        {
+            uint32_t red;
+            uint32_t green;
+            uint32_t blue;
+        };
+
+        static const uint64_t maxTableRegion = UINT32_MAX / 255;
+
+        int width;
+        int height;
         int resolution;
 
+        /**
+         * Summed-area table of the source image, (width + 1) x (height + 1)
+         * entries, built once at construction so any region average can
+         * be found with four lookups. Empty if the regions are too large.
+         */
+        vector<ColorSum> sums;
+
+        /**
+         * Average color of each region, in row-major order, found directly
+         * instead when the regions are too large for the table.
+         */
+        vector<RGBAPixel> regionColors;
+
+        const ColorSum & sumAt(int x, int y) const;
+        void getRegionBounds(int row, int col, int & startX, int & endX, int & startY, int & endY) const;
+
         static uint64_t divide(uint64_t a, uint64_t b);
 };
 
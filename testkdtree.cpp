@@ -1,6 +1,9 @@
+#include <atomic>
 #include <iostream>
 #include <sstream>
+#include <thread>
 #include "coloredout.h"
+#include "dynamickdtree.h"
 #include "kdtree.h"
 #include "point.h"
 
@@ -398,6 +401,428 @@ void testLeftRecurse()
 }
 
 
+/**
+ * Test that the packed storage mode finds the same neighbors as searching
+ * the Points directly, including when there are ties
+ */
+void testPackedNNS()
+{
+	output_header("testPackedNNS()",
+	              "packed byte storage gives the same results as Point storage");
+
+	vector< Point<3> > points;
+	for (int i = 0; i < 200; i++)
+		points.push_back(Point<3>((i * 37) % 16 * 17, (i * 11) % 8 * 32, (i * 5) % 4 * 85));
+
+	KDTree<3> packedTree(points);
+	KDTree<3> pointTree(points, false);
+	cout << "packedTree.isPacked() = " << packedTree.isPacked() << endl; // should print true
+	cout << "pointTree.isPacked()  = " << pointTree.isPacked() << endl; // should print false
+
+	bool same = true;
+	for (int r = 0; r < 256; r += 15)
+		for (int g = 0; g < 256; g += 15)
+			for (int b = 0; b < 256; b += 15)
+			{
+				Point<3> target(r, g, b);
+				same &= (packedTree.findNearestNeighbor(target) == pointTree.findNearestNeighbor(target));
+			}
+	cout << "all neighbors match = " << same << endl; // should print true
+	cout << endl;
+}
+
+
+/**
+ * Test that searches agree with checking every point, on trees of every
+ * size from 1 to 40 so that searches run into empty subtrees and have to
+ * cross back over splitting planes after the median becomes the best
+ */
+void testBruteForceNNS()
+{
+	output_header("testBruteForceNNS()",
+	              "findNearestNeighbor matches checking every point");
+
+	bool same = true;
+	for (int size = 1; size <= 40; size++)
+	{
+		vector< Point<3> > points;
+		for (int i = 0; i < size; i++)
+			points.push_back(Point<3>((i * 37 + size) % 64 * 4, (i * 11 + size * 3) % 32 * 8, (i * 5) % 16 * 16));
+		KDTree<3> packedTree(points);
+		KDTree<3> pointTree(points, false);
+
+		for (int q = 0; q < 300; q++)
+		{
+			Point<3> target((q * 13) % 256, (q * 29 + size) % 256, (q * 7) % 256);
+			Point<3> expected = points[0];
+			double expectedDistance = 1e300;
+			for (int i = 0; i < size; i++)
+			{
+				double distance = 0;
+				for (int d = 0; d < 3; d++)
+					distance += (target[d] - points[i][d]) * (target[d] - points[i][d]);
+				if (distance < expectedDistance || (distance == expectedDistance && points[i] < expected))
+				{
+					expected = points[i];
+					expectedDistance = distance;
+				}
+			}
+			same &= packedTree.findNearestNeighbor(target) == expected;
+			same &= pointTree.findNearestNeighbor(target) == expected;
+		}
+	}
+	cout << "all neighbors match = " << same << endl; // should print true
+	cout << endl;
+}
+
+
+/**
+ * Test that batched queries find the same neighbors as one query at a time,
+ * with and without threads
+ */
+void testBatchNNS()
+{
+	output_header("testBatchNNS()",
+	              "findNearestNeighbors matches findNearestNeighbor");
+
+	vector< Point<3> > points;
+	for (int i = 0; i < 100; i++)
+		points.push_back(Point<3>((i * 37) % 101, (i * 11) % 53 * 2.5, (i * 5) % 7 * 15.0));
+	KDTree<3> tree(points);
+
+	vector< Point<3> > queries;
+	for (int i = 0; i < 5000; i++)
+		queries.push_back(Point<3>((i * 13) % 120, (i * 7) % 140 * 1.0, (i / 50) % 9 * 11.0));
+	// the last query stretches the Morton keys' range so far that these share
+	// a key, although they are not all equal and equal ones are not adjacent
+	for (int i = 0; i < 300; i++)
+		queries.push_back(Point<3>(i % 3 * 0.25, 40, 40));
+	queries.push_back(Point<3>(1e9, 1e9, 1e9));
+
+	vector< Point<3> > serial  = tree.findNearestNeighbors(queries);
+	vector< Point<3> > threaded = tree.findNearestNeighbors(queries, 4);
+	bool same = serial.size() == queries.size() && threaded.size() == queries.size();
+	for (size_t i = 0; same && i < queries.size(); i++)
+		same = serial[i] == tree.findNearestNeighbor(queries[i]) && threaded[i] == serial[i];
+	cout << "all neighbors match = " << same << endl; // should print true
+	cout << endl;
+}
+
+
+/**
+ * Test that a tree rebuilt from another tree's nodes is the same tree
+ */
+void testFromNodes()
+{
+	output_header("testFromNodes()",
+	              "fromNodes(getNodes()) gives the same tree");
+
+	vector< Point<3> > points;
+	for (int i = 0; i < 150; i++)
+		points.push_back(Point<3>((i * 29) % 256, (i * 83) % 256, (i * 7) % 256));
+	KDTree<3> tree(points);
+	KDTree<3> copy = KDTree<3>::fromNodes(tree.getNodes());
+
+	cout << "copy.isPacked() = " << copy.isPacked() << endl; // should print true
+	bool same = copy.getNodes() == tree.getNodes();
+	for (int r = 0; r < 256; r += 17)
+		for (int g = 0; g < 256; g += 17)
+			for (int b = 0; b < 256; b += 17)
+				same &= copy.findNearestNeighbor(Point<3>(r, g, b)) == tree.findNearestNeighbor(Point<3>(r, g, b));
+	cout << "same nodes and neighbors = " << same << endl; // should print true
+	cout << endl;
+}
+
+
+/**
+ * Sorts every point by its distance to target, breaking ties with operator<
+ */
+vector< Point<3> > sortedByDistance(const vector< Point<3> > & points, const Point<3> & target)
+{
+	vector< pair<double, Point<3> > > byDistance;
+	for (size_t i = 0; i < points.size(); i++)
+	{
+		double d = 0;
+		for (int j = 0; j < 3; j++)
+			d += (points[i][j] - target[j]) * (points[i][j] - target[j]);
+		byDistance.push_back(make_pair(d, points[i]));
+	}
+	sort(byDistance.begin(), byDistance.end());
+
+	vector< Point<3> > sorted;
+	for (size_t i = 0; i < byDistance.size(); i++)
+		sorted.push_back(byDistance[i].second);
+	return sorted;
+}
+
+
+/**
+ * Test that k-nearest and radius queries find the same points as sorting
+ * every point by distance, including when there are ties
+ */
+void testKNearestAndRadius()
+{
+	output_header("testKNearestAndRadius()",
+	              "findKNearest and findWithinRadius match a linear scan");
+
+	vector< Point<3> > points;
+	for (int i = 0; i < 120; i++)
+		points.push_back(Point<3>((i * 37) % 16 * 4, (i * 11) % 8 * 8, (i * 5) % 4 * 16));
+	KDTree<3> tree(points);
+
+	bool sameK = true;
+	bool sameRadius = true;
+	bool firstIsNearest = true;
+	for (int i = 0; i < 300; i++)
+	{
+		Point<3> target((i * 13) % 70, (i * 7) % 66, (i * 3) % 50);
+		vector< Point<3> > sorted = sortedByDistance(points, target);
+
+		int k = 1 + i % 10;
+		vector< Point<3> > nearest = tree.findKNearest(target, k);
+		sameK &= vector< Point<3> >(sorted.begin(), sorted.begin() + k) == nearest;
+		firstIsNearest &= nearest[0] == tree.findNearestNeighbor(target);
+
+		double radiusSquared = (i % 6) * 60.0;
+		vector< Point<3> > within;
+		for (size_t j = 0; j < sorted.size(); j++)
+		{
+			double d = 0;
+			for (int dim = 0; dim < 3; dim++)
+				d += (sorted[j][dim] - target[dim]) * (sorted[j][dim] - target[dim]);
+			if (d <= radiusSquared)
+				within.push_back(sorted[j]);
+		}
+		sameRadius &= tree.findWithinRadius(target, radiusSquared) == within;
+	}
+	cout << "k nearest match = " << sameK << endl; // should print true
+	cout << "first is the nearest neighbor = " << firstIsNearest << endl; // should print true
+	cout << "points within radius match = " << sameRadius << endl; // should print true
+	cout << "size of 200 nearest of 120 = " << tree.findKNearest(Point<3>(0, 0, 0), 200).size() << endl; // should print 120
+	cout << endl;
+}
+
+
+/**
+ * Test that building a tree on several threads gives the same tree
+ */
+void testParallelCtor()
+{
+	output_header("testParallelCtor()",
+	              "building on 4 threads gives the same nodes");
+
+	vector< Point<3> > points;
+	for (int i = 0; i < 60000; i++)
+		points.push_back(Point<3>((i * 37) % 97, (i * 11) % 53 * 2.5, (i * 5) % 31));
+	KDTree<3> serial(points);
+	KDTree<3> threaded(points, true, 4);
+	cout << "same nodes = " << (serial.getNodes() == threaded.getNodes()) << endl; // should print true
+	cout << endl;
+}
+
+
+/**
+ * Checks that every node of the subtree over [low, high] splits it as
+ * kdtree.h requires: the nodes before it are not larger in its dimension
+ * and the ones after it are not smaller (equal points may go either way)
+ */
+bool followsLayout(const KDTree<3> & tree, const vector< Point<3> > & nodes, int low, int high, int dim)
+{
+	if (low > high)
+		return true;
+	int median = (low + high) / 2;
+	for (int i = low; i < median; i++)
+		if (tree.smallerDimVal(nodes[median], nodes[i], dim))
+			return false;
+	for (int i = median + 1; i <= high; i++)
+		if (tree.smallerDimVal(nodes[i], nodes[median], dim))
+			return false;
+	return followsLayout(tree, nodes, low, median - 1, (dim + 1) % 3)
+		&& followsLayout(tree, nodes, median + 1, high, (dim + 1) % 3);
+}
+
+
+/**
+ * Test that trees over many duplicates and sorted points are built quickly
+ * and still follow the required layout
+ */
+void testDuplicateCtor()
+{
+	output_header("testDuplicateCtor()",
+	              "duplicate-heavy and sorted points follow the median layout");
+
+	vector< Point<3> > duplicates;
+	for (int i = 0; i < 50000; i++)
+		duplicates.push_back(Point<3>(i % 4 * 10, 5, (i / 7) % 3));
+	vector< Point<3> > sorted;
+	for (int i = 0; i < 50000; i++)
+		sorted.push_back(Point<3>(i / 2500, i / 50 % 50, i % 50));
+	vector< Point<3> > reversed(sorted.rbegin(), sorted.rend());
+
+	KDTree<3> duplicateTree(duplicates);
+	KDTree<3> sortedTree(sorted);
+	KDTree<3> reversedTree(reversed);
+	cout << "duplicates follow layout = "
+	     << followsLayout(duplicateTree, duplicateTree.getNodes(), 0, duplicates.size() - 1, 0) << endl; // should print true
+	cout << "sorted follow layout = "
+	     << followsLayout(sortedTree, sortedTree.getNodes(), 0, sorted.size() - 1, 0) << endl; // should print true
+	cout << "reversed gives same nodes = " << (reversedTree.getNodes() == sortedTree.getNodes()) << endl; // should print true
+	cout << endl;
+}
+
+
+/**
+ * Test that a tree over a median-of-3 killer sequence, which leaves
+ * median-of-three pivots at the edge of each range, follows the required
+ * layout and is the same tree as the one over the same points in order
+ */
+void testKillerCtor()
+{
+	output_header("testKillerCtor()",
+	              "median-of-3 killer input follows the median layout");
+
+	// Musser's sequence: 1, k + 1, 3, k + 3, ..., followed by 2, 4, ..., 2k
+	const int k = 25000;
+	vector<int> killer(2 * k);
+	for (int i = 1; i <= k; i++)
+	{
+		if (i % 2 == 1)
+		{
+			killer[i - 1] = i;
+			killer[i] = k + i;
+		}
+		killer[k + i - 1] = 2 * i;
+	}
+
+	vector< Point<3> > points;
+	vector< Point<3> > sorted(2 * k);
+	for (int i = 0; i < 2 * k; i++)
+	{
+		points.push_back(Point<3>(killer[i], killer[(i * 7) % (2 * k)], killer[2 * k - 1 - i]));
+		sorted[killer[i] - 1] = points.back();
+	}
+
+	KDTree<3> killerTree(points);
+	KDTree<3> sortedTree(sorted);
+	cout << "killer follows layout = "
+	     << followsLayout(killerTree, killerTree.getNodes(), 0, points.size() - 1, 0) << endl; // should print true
+	cout << "killer gives same nodes as sorted = " << (killerTree.getNodes() == sortedTree.getNodes()) << endl; // should print true
+	cout << endl;
+}
+
+
+/**
+ * Test that a tree points are inserted into and erased from finds the same
+ * neighbors as a KDTree built from the points it holds, including while
+ * another thread is searching it
+ */
+void testDynamicTree()
+{
+	output_header("testDynamicTree()",
+	              "DynamicKDTree matches a rebuilt KDTree after inserts and erases");
+
+	DynamicKDTree<3> tree;
+	vector< Point<3> > live;
+	bool same = true;
+
+	// one thread keeps searching while the tree changes; every answer must
+	// be a point that was inserted at some time
+	std::atomic<bool> changing(true);
+	std::atomic<bool> answersValid(true);
+	std::thread searcher([&]() {
+		for (int i = 0; changing; i++)
+		{
+			Point<3> found = tree.findNearestNeighbor(Point<3>(i % 64, i % 7 * 9, i % 13 * 5));
+			if (tree.size() > 0 && (int) found[0] % 2 != 0)
+				answersValid = false;
+		}
+	});
+
+	for (int i = 0; i < 600; i++)
+	{
+		Point<3> p((i * 37) % 32 * 2, (i * 11) % 16 * 4, (i * 5) % 8 * 8);
+		tree.insert(p);
+		live.push_back(p);
+		if (i % 3 == 2)
+		{
+			Point<3> old = live[(i * 7) % live.size()];
+			tree.erase(old);
+			live.erase(find(live.begin(), live.end(), old));
+		}
+
+		if (i % 50 == 49)
+		{
+			KDTree<3> rebuilt(live);
+			for (int q = 0; q < 64; q++)
+			{
+				Point<3> target((q * 13) % 70, (q * 7) % 66, (q * 3) % 60);
+				same &= tree.findNearestNeighbor(target) == rebuilt.findNearestNeighbor(target);
+			}
+			same &= tree.size() == live.size();
+		}
+	}
+	changing = false;
+	searcher.join();
+
+	bool erasedAll = true;
+	while (!live.empty())
+	{
+		erasedAll &= tree.erase(live.back());
+		live.pop_back();
+	}
+	erasedAll &= !tree.erase(Point<3>(0, 0, 0)) && tree.size() == 0;
+
+	// inserting an erased point again must only bring back the new copy
+	vector< Point<3> > grid;
+	for (int i = 0; i < 100; i++)
+		grid.push_back(Point<3>(i % 10 * 10, i / 10 * 10, 0));
+	DynamicKDTree<3> reused(grid);
+	Point<3> corner(0, 0, 0);
+	bool reinserted = reused.erase(corner);
+	reused.insert(corner);
+	reinserted &= reused.findNearestNeighbor(Point<3>(1, 1, 0)) == corner && reused.size() == 100;
+	reinserted &= reused.erase(corner) && !reused.erase(corner) && reused.size() == 99;
+	reinserted &= reused.findNearestNeighbor(Point<3>(1, 1, 0)) == Point<3>(0, 10, 0);
+
+	// queries inside a dense cluster of erased points must pass over them
+	// to the nearest live point, which may be outside the cluster
+	vector< Point<3> > clusterPoints;
+	vector< Point<3> > clusterLive;
+	vector< Point<3> > clusterErased;
+	for (int i = 0; i < 1000; i++)
+	{
+		Point<3> p(100 + i % 10, 100 + i / 10 % 10, 100 + i / 100);
+		clusterPoints.push_back(p);
+		if (i % 97 == 0)
+			clusterLive.push_back(p);
+		else
+			clusterErased.push_back(p);
+	}
+	for (int i = 0; i < 3000; i++)
+	{
+		Point<3> p((i * 37) % 251, (i * 11) % 241, (i * 5) % 239);
+		clusterPoints.push_back(p);
+		clusterLive.push_back(p);
+	}
+	DynamicKDTree<3> clustered(clusterPoints);
+	bool clusterSkipped = true;
+	for (size_t i = 0; i < clusterErased.size(); i++)
+		clusterSkipped &= clustered.erase(clusterErased[i]);
+	KDTree<3> clusterRebuilt(clusterLive);
+	for (int q = 0; q < 200; q++)
+	{
+		Point<3> target(99 + q % 12, 99 + q / 12 % 12, 99 + q * 7 % 12);
+		clusterSkipped &= clustered.findNearestNeighbor(target) == clusterRebuilt.findNearestNeighbor(target);
+	}
+	clusterSkipped &= clustered.size() == clusterLive.size();
+
+	cout << "neighbors match = " << same << endl; // should print true
+	cout << "concurrent answers valid = " << answersValid << endl; // should print true
+	cout << "erased everything = " << erasedAll << endl; // should print true
+	cout << "reinserted point erased once = " << reinserted << endl; // should print true
+	cout << "erased cluster skipped = " << clusterSkipped << endl; // should print true
+	cout << endl;
+}
 
 int main(int argc, char** argv)
 {
@@ -430,5 +855,14 @@ int main(int argc, char** argv)
 	testDeceptiveMines();
 	testTieBreaking();
 	testLeftRecurse(); 
+	testPackedNNS();
+	testBruteForceNNS();
+	testBatchNNS();
+	testFromNodes();
+	testKNearestAndRadius();
+	testParallelCtor();
+	testDuplicateCtor();
+	testKillerCtor();
+	testDynamicTree();
 }
 
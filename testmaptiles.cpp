@@ -35,6 +35,157 @@ int main()
 
 	actualImage.writeToFile("testmaptiles.png");
 
+	MosaicCanvas* threadedCanvas = mapTiles(source, tileList, 4);
+	if (threadedCanvas->drawMosaic(10) != actualImage)
+	{
+		cerr << "ERROR: Mapping tiles with 4 threads gave a different mosaic" << endl;
+		exit(1);
+	}
+	if (canvas->drawMosaic(10, 4) != actualImage)
+	{
+		cerr << "ERROR: Drawing with 4 threads gave a different mosaic" << endl;
+		exit(1);
+	}
+	if (!canvas->writeMosaic("testmaptiles_streamed.png", 10, 4)
+			|| PNG("testmaptiles_streamed.png") != actualImage)
+	{
+		cerr << "ERROR: Writing the mosaic band by band gave a different image" << endl;
+		exit(1);
+	}
+	remove("testmaptiles_streamed.png");
+
+	// Two threads write bands of two tile rows, so only the ten tiles of
+	// one band should be scaled at a time, out of the sixty the mosaic uses.
+	// Column 0 uses the same tile in every row
+	vector<TileImage> bandTiles;
+	for (int i = 0; i < 60; i++)
+	{
+		PNG tile(3, 3);
+		for (int y = 0; y < 3; y++)
+			for (int x = 0; x < 3; x++)
+				*tile(x, y) = RGBAPixel(i * 4, (i * 37 + x) & 255, (i * 91 + y) & 255);
+		bandTiles.push_back(TileImage(tile));
+	}
+	MosaicCanvas bandCanvas(12, 5, make_shared<const vector<TileImage> >(bandTiles));
+	for (int row = 0; row < 12; row++)
+		for (int col = 0; col < 5; col++)
+			bandCanvas.setTile(row, col, (size_t) (col == 0 ? 0 : row * 5 + col));
+	PNG bandImage = bandCanvas.drawMosaic(7, 2);
+	if (!bandCanvas.writeMosaic("testmaptiles_bands.png", 7, 2)
+			|| PNG("testmaptiles_bands.png") != bandImage)
+	{
+		cerr << "ERROR: Writing a mosaic of many tiles band by band gave a different image" << endl;
+		exit(1);
+	}
+	if (bandCanvas.getPeakScaledTiles() > 10)
+	{
+		cerr << "ERROR: Writing the mosaic held " << bandCanvas.getPeakScaledTiles()
+		     << " scaled tiles at once rather than one band's" << endl;
+		exit(1);
+	}
+	remove("testmaptiles_bands.png");
+
+	PNGWriteOptions stripedOptions;
+	stripedOptions.numThreads = 4;
+	if (!actualImage.writeToFile("testmaptiles_striped.png", stripedOptions)
+			|| PNG("testmaptiles_striped.png") != actualImage)
+	{
+		cerr << "ERROR: Writing the mosaic in stripes on 4 threads gave a different image" << endl;
+		exit(1);
+	}
+	remove("testmaptiles_striped.png");
+
+	// Stripes are about a megabyte, and two threads compress two stripes per
+	// batch, so this image spans two batches of two stripes each. Its rows
+	// repeat every 300, so stripes refer back into the ones before them
+	PNG tall(256, 3500);
+	for (size_t y = 0; y < tall.height(); y++)
+		for (size_t x = 0; x < tall.width(); x++)
+			*tall(x, y) = RGBAPixel((x * 3 + y % 300) & 255, (x ^ (y % 300)) & 255, (x + y / 5) & 255, 200 + y % 7);
+	PNGWriteOptions singleOptions;
+	PNGWriteOptions twoStripeOptions;
+	twoStripeOptions.numThreads = 2;
+	if (!tall.writeToFile("testmaptiles_single.png", singleOptions)
+			|| !tall.writeToFile("testmaptiles_batches.png", twoStripeOptions)
+			|| PNG("testmaptiles_batches.png") != PNG("testmaptiles_single.png")
+			|| PNG("testmaptiles_batches.png") != tall)
+	{
+		cerr << "ERROR: Writing an image in several batches of stripes gave a different image" << endl;
+		exit(1);
+	}
+	remove("testmaptiles_single.png");
+	remove("testmaptiles_batches.png");
+
+	// Each channel of this white image sums to more than 2^32, so the
+	// 32-bit summed-area table wraps around. Quarter regions still fit in
+	// 32 bits and are found from the table; one region of the whole image
+	// does not and has to be averaged directly
+	PNG white(4200, 4100);
+	SourceImage quarters(white, 2);
+	SourceImage whole(white, 1);
+	if (quarters.getRows() != 2 || quarters.getColumns() != 2
+			|| quarters.getRegionColor(1, 1) != RGBAPixel(255, 255, 255)
+			|| whole.getRegionColor(0, 0) != RGBAPixel(255, 255, 255))
+	{
+		cerr << "ERROR: Regions of a source image whose color sums pass 2^32 have the wrong color" << endl;
+		exit(1);
+	}
+
+	TileLookupTable lookupTable;
+	vector< Point<3> > tileColors;
+	vector<size_t> nodeTiles;
+	for (size_t i = 0; i < tileList.size(); i++)
+	{
+		RGBAPixel color = tileList[i].getAverageColor();
+		tileColors.push_back(Point<3>(color.red, color.green, color.blue));
+	}
+	KDTree<3> tree(tileColors);
+	for (size_t i = 0; i < tree.getNodes().size(); i++)
+		nodeTiles.push_back(find(tileColors.begin(), tileColors.end(), tree.getNodes()[i]) - tileColors.begin());
+	auto sharedTiles = make_shared<const vector<TileImage> >(tileList);
+	MosaicCanvas* lookupCanvas = mapTiles(source, sharedTiles, tree, nodeTiles, 4, &lookupTable);
+	TileLookupTable savedTable;
+	if (lookupCanvas->drawMosaic(10) != actualImage || lookupTable.size() == 0
+			|| !lookupTable.writeToFile("testmaptiles.lookup", 1)
+			|| !savedTable.readFromFile("testmaptiles.lookup", 1, tileList.size())
+			|| savedTable.size() != lookupTable.size() || savedTable.readFromFile("testmaptiles.lookup", 2, tileList.size()))
+	{
+		cerr << "ERROR: Mapping tiles through a lookup table gave a different mosaic" << endl;
+		exit(1);
+	}
+	delete lookupCanvas;
+	savedTable.readFromFile("testmaptiles.lookup", 1, tileList.size());
+	lookupCanvas = mapTiles(source, sharedTiles, tree, nodeTiles, 1, &savedTable);
+	if (lookupCanvas->drawMosaic(10) != actualImage || savedTable.size() != lookupTable.size())
+	{
+		cerr << "ERROR: Mapping tiles through a saved lookup table gave a different mosaic" << endl;
+		exit(1);
+	}
+	delete lookupCanvas;
+	remove("testmaptiles.lookup");
+
+	// entries that are not tiles are searched for again rather than drawn
+	TileLookupTable staleTable;
+	for (int i = 0; i < source.getRows(); i++)
+		for (int j = 0; j < source.getColumns(); j++)
+			staleTable.insert(source.getRegionColor(i, j), tileList.size() + 5);
+	lookupCanvas = mapTiles(source, sharedTiles, tree, nodeTiles, 1, &staleTable);
+	if (lookupCanvas->drawMosaic(10) != actualImage || staleTable.lookup(source.getRegionColor(0, 0)) >= tileList.size())
+	{
+		cerr << "ERROR: Mapping tiles through a lookup table with stale entries gave a different mosaic" << endl;
+		exit(1);
+	}
+	delete lookupCanvas;
+
+	canvas->setAtlas(make_shared<const TileAtlas>(TileAtlas::fromTiles(tileList, 10)));
+	if (canvas->drawMosaic(10) != actualImage)
+	{
+		cerr << "ERROR: Drawing from a tile atlas gave a different mosaic" << endl;
+		exit(1);
+	}
+
+	delete threadedCanvas;
 	delete canvas;
+	remove("testmaptiles.png");
 }
 
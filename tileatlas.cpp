@@ -0,0 +1,62 @@
+/**
+ * @file tileatlas.cpp
+ * Implementation of the TileAtlas class.
+ */
+
+#include <stdlib.h>
+#include <cstring>
+#include <iostream>
+
+#include "parallel.h"
+#include "tileatlas.h"
+
+using namespace std;
+using namespace util;
+
+TileAtlas::TileAtlas()
+	: numTiles(0), tileResolution(0), pixels(NULL)
+{ /* nothing */ }
+
+TileAtlas::TileAtlas(size_t theNumTiles, int theTileResolution)
+	: numTiles(theNumTiles), tileResolution(theTileResolution), pixels(NULL)
+{
+	void * arena = NULL;
+	if (posix_memalign(&arena, alignment, max<size_t>(dataSize(), 1)) != 0)
+	{
+		cerr << "ERROR: Could not allocate a tile atlas of " << dataSize() << " bytes" << endl;
+		exit(-1);
+	}
+	pixels = static_cast<const RGBAPixel *>(arena);
+	owner = shared_ptr<const void>(arena, free);
+}
+
+TileAtlas::TileAtlas(size_t theNumTiles, int theTileResolution, const RGBAPixel * thePixels, shared_ptr<const void> theOwner)
+	: numTiles(theNumTiles), tileResolution(theTileResolution), pixels(thePixels), owner(theOwner)
+{ /* nothing */ }
+
+TileAtlas TileAtlas::fromTiles(const vector<TileImage> & tiles, int tileResolution, int numThreads)
+{
+	vector<size_t> ids(tiles.size());
+	for (size_t i = 0; i < ids.size(); i++)
+		ids[i] = i;
+	return fromTiles(tiles, ids, tileResolution, numThreads);
+}
+
+TileAtlas TileAtlas::fromTiles(const vector<TileImage> & tiles, const vector<size_t> & ids, int tileResolution,
+		int numThreads)
+{
+	TileAtlas atlas(tiles.size(), tileResolution);
+	RGBAPixel * arena = const_cast<RGBAPixel *>(atlas.pixels);
+	size_t tilePixels = tileResolution * tileResolution;
+
+	forEachChunk(ids.size(), 16, numThreads, [&](size_t begin, size_t end)
+	{
+		PNG scaled(tileResolution, tileResolution);
+		for (size_t i = begin; i < end; i++)
+		{
+			tiles[ids[i]].paste(scaled, 0, 0, tileResolution);
+			memcpy(arena + ids[i] * tilePixels, scaled.row(0), tilePixels * sizeof(RGBAPixel));
+		}
+	});
+	return atlas;
+}
@@ -0,0 +1,120 @@
+/**
+ * @file tileatlas.h
+ * Definition of the TileAtlas class.
+ */
+
+#ifndef TILEATLAS_H
+#define TILEATLAS_H
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "png.h"
+#include "tileimage.h"
+
+using std::shared_ptr;
+using std::vector;
+
+/**
+ * The pixels of a set of tiles, all scaled to the same resolution and
+ * packed one after another into a single aligned arena. Tile i is the
+ * resolution x resolution block of pixels, in row-major order, starting
+ * at tile(i), so tiles can be drawn or averaged by streaming linearly
+ * through memory, and the whole atlas can be written out or mapped in
+ * as one block.
+ */
+class TileAtlas
+{
+	public:
+	/**
+	 * Alignment of the arena, in bytes.
+	 */
+	static const size_t alignment = 64;
+
+	/**
+	 * Creates an empty atlas.
+	 */
+	TileAtlas();
+
+	/**
+	 * Creates an atlas with room for the given number of tiles at the
+	 * given resolution. The pixels start out uninitialized.
+	 * @param numTiles Number of tiles.
+	 * @param tileResolution Width and height of each tile.
+	 */
+	TileAtlas(size_t numTiles, int tileResolution);
+
+	/**
+	 * Creates an atlas whose pixels are stored elsewhere, such as in a
+	 * mapped file. The pixels must be aligned to alignment bytes.
+	 * @param numTiles Number of tiles.
+	 * @param tileResolution Width and height of each tile.
+	 * @param pixels The first pixel of the first tile.
+	 * @param owner Keeps the pixels alive for as long as the atlas, or
+	 *  any copy of it, is.
+	 */
+	TileAtlas(size_t numTiles, int tileResolution, const RGBAPixel * pixels, shared_ptr<const void> owner);
+
+	/**
+	 * Scales each of the given tiles to the given resolution and packs
+	 * them into a new atlas, in the same order.
+	 * @param tiles The tiles to pack.
+	 * @param tileResolution Width and height to scale each tile to.
+	 * @param numThreads Number of threads to scale tiles on.
+	 * @return The atlas.
+	 */
+	static TileAtlas fromTiles(const vector<TileImage> & tiles, int tileResolution, int numThreads = 1);
+
+	/**
+	 * Packs only some of the given tiles into a new atlas, each at its
+	 * index in tiles. The other tiles' pixels are left uninitialized and
+	 * must not be drawn; their pages of the arena are never touched, so
+	 * they take no memory.
+	 * @param tiles The tiles.
+	 * @param ids Indices of the tiles to scale and pack.
+	 * @param tileResolution Width and height to scale each tile to.
+	 * @param numThreads Number of threads to scale tiles on.
+	 * @return The atlas.
+	 */
+	static TileAtlas fromTiles(const vector<TileImage> & tiles, const vector<size_t> & ids, int tileResolution,
+			int numThreads = 1);
+
+	/**
+	 * Gets the number of tiles in the atlas.
+	 * @return The number of tiles.
+	 */
+	size_t size() const { return numTiles; }
+
+	/**
+	 * Gets the width and height of each tile.
+	 * @return The resolution of the tiles.
+	 */
+	int getTileResolution() const { return tileResolution; }
+
+	/**
+	 * Gets the first pixel of a tile. The index is not checked.
+	 * @param i Index of the tile.
+	 * @return A pointer to the upper left pixel of the tile.
+	 */
+	const RGBAPixel * tile(size_t i) const { return pixels + i * tileResolution * tileResolution; }
+
+	/**
+	 * Gets the whole arena, for writing it out as one block.
+	 * @return A pointer to the first pixel of the first tile.
+	 */
+	const RGBAPixel * data() const { return pixels; }
+
+	/**
+	 * Gets the size of the whole arena.
+	 * @return The number of bytes of pixels in the atlas.
+	 */
+	size_t dataSize() const { return numTiles * tileResolution * tileResolution * sizeof(RGBAPixel); }
+
+	private:
+	size_t numTiles;
+	int tileResolution;
+	const RGBAPixel * pixels;
+	shared_ptr<const void> owner;
+};
+
+#endif // TILEATLAS_H
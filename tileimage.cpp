@@ -4,21 +4,105 @@
 using namespace std;
 
 TileImage::TileImage()
-	: image(1, 1)
+	: pixels(make_shared<Pixels>())
 {
-	averageColor = *image(0, 0);
+	pixels->thumbnailResolution = 0;
+	averageColor = *pixels->image(0, 0);
+	imageResolution = pixels->image.width();
 }
 
-TileImage::TileImage(const PNG & source)
-	: image(cropSourceImage(source))
+TileImage::TileImage(PNG source, int thumbnailResolution)
+	: pixels(make_shared<Pixels>())
 {
+	pixels->thumbnailResolution = thumbnailResolution;
+	pixels->image = cropSourceImage(move(source));
 	averageColor = calculateAverageColor();
+	imageResolution = pixels->image.width();
+	if (thumbnailResolution > 0)
+		makeThumbnails(*pixels);
 }
 
-PNG TileImage::cropSourceImage(const PNG & source)
+TileImage::TileImage(const string & fileName, RGBAPixel theAverageColor, int theResolution,
+		int thumbnailResolution)
+	: pixels(make_shared<Pixels>()), averageColor(theAverageColor), imageResolution(theResolution)
+{
+	pixels->fileName = fileName;
+	pixels->thumbnailResolution = thumbnailResolution;
+}
+
+const PNG & TileImage::getImage() const
+{
+	call_once(pixels->loaded, [this]()
+	{
+		if (!pixels->fileName.empty())
+		{
+			pixels->image = cropSourceImage(PNG(pixels->fileName));
+			if (pixels->thumbnailResolution > 0)
+				makeThumbnails(*pixels);
+		}
+	});
+	return pixels->image;
+}
+
+const PNG & TileImage::getSourceFor(int resolution) const
+{
+	const PNG & image = getImage();
+	const vector<PNG> & thumbnails = pixels->thumbnails;
+	if (thumbnails.empty())
+		return image;
+
+	// The smallest thumbnail that is still at least as large as the tile
+	// is drawn, or the largest one if none are
+	size_t level = 0;
+	while (level + 1 < thumbnails.size() && static_cast<int>(thumbnails[level + 1].width()) >= resolution)
+		level++;
+	return thumbnails[level];
+}
+
+void TileImage::makeThumbnails(Pixels & pixels)
+{
+	int sourceResolution = pixels.image.width();
+	int size = min(sourceResolution, pixels.thumbnailResolution);
+
+	// One level at this size, then one per power of two below it, so the
+	// levels are moved in once rather than again on each reallocation
+	size_t levels = 1;
+	for (int smaller = 1; smaller < size; smaller *= 2)
+		levels++;
+	pixels.thumbnails.reserve(levels);
+
+	if (size == sourceResolution)
+		pixels.thumbnails.push_back(move(pixels.image));
+	else
+	{
+		PNG largest(size, size);
+		scale(pixels.image, largest, 0, 0, size);
+		pixels.thumbnails.push_back(move(largest));
+	}
+
+	// Each smaller level is the next power of two down, box filtered from
+	// the level above it
+	while (size > 1)
+	{
+		int next = 1;
+		while (next * 2 < size)
+			next *= 2;
+		PNG smaller(next, next);
+		scale(pixels.thumbnails.back(), smaller, 0, 0, next);
+		pixels.thumbnails.push_back(move(smaller));
+		size = next;
+	}
+
+	pixels.image = PNG();
+}
+
+PNG TileImage::cropSourceImage(PNG source)
 {
 	int height = source.height();
 	int width  = source.width();
+	if (width == height)
+		return source;
+
 	int resolution = min(width, height);
 	
 	int startX = 0;
@@ -33,27 +117,29 @@ PNG TileImage::cropSourceImage(const PNG & source)
 	}
 
 	PNG cropped(resolution, resolution);
+	PNGView region = source.view(startX, startY, resolution, resolution);
 
 	for (int y = 0; y < resolution; y++)
-		for (int x = 0; x < resolution; x++)
-			*cropped(x, y) = *source(startX + x, startY + y);
+		copy(region.row(y), region.row(y) + resolution, cropped.row(y));
 
 	return cropped;
 }
 
 RGBAPixel TileImage::calculateAverageColor() const
 {
+	const PNG & image = getImage();
 	uint64_t r = 0;
 	uint64_t g = 0;
 	uint64_t b = 0;
 
 	for (size_t y = 0; y < image.height(); y++)
 	{
+		const RGBAPixel * row = image.row(y);
 		for (size_t x = 0; x < image.width(); x++)
 		{
-			r += image(x, y)->red;
-			g += image(x, y)->green;
-			b += image(x, y)->blue;
+			r += row[x].red;
+			g += row[x].green;
+			b += row[x].blue;
 		}
 	}
 
@@ -67,11 +153,20 @@ RGBAPixel TileImage::calculateAverageColor() const
 
 void TileImage::paste(PNG & canvas, int startX, int startY, int resolution) const
 {
+	// Scale from the decoded image itself, in case the file has changed
+	// since its resolution was recorded
+	scale(getSourceFor(resolution), canvas, startX, startY, resolution);
+}
+
+void TileImage::scale(const PNG & image, PNG & canvas, int startX, int startY, int resolution)
+{
+	int sourceResolution = image.width();
+
 	// If possible, avoid floating point comparisons. This helps ensure that students'
 	// photomosaic's are diff-able with solutions
-	if (getResolution() % resolution == 0)
+	if (sourceResolution % resolution == 0)
 	{
-		int scalingRatio = getResolution() / resolution;
+		int scalingRatio = sourceResolution / resolution;
 		
 		for (int x = 0; x < resolution; x++)
 		{
@@ -82,13 +177,13 @@ void TileImage::paste(PNG & canvas, int startX, int startY, int resolution) cons
 				int pixelStartY = (y)   * scalingRatio;
 				int pixelEndY   = (y+1) * scalingRatio;
 				
-				*canvas(startX + x, startY + y) = getScaledPixelInt(pixelStartX, pixelEndX, pixelStartY, pixelEndY);
+				*canvas(startX + x, startY + y) = getScaledPixelInt(image, pixelStartX, pixelEndX, pixelStartY, pixelEndY);
 			}
 		}
 	}
 	else // scaling is necessary
 	{
-		double scalingRatio = static_cast<double>(getResolution()) / resolution;
+		double scalingRatio = static_cast<double>(sourceResolution) / resolution;
 
 		for (int x = 0; x < resolution; x++)
 		{
@@ -99,13 +194,13 @@ void TileImage::paste(PNG & canvas, int startX, int startY, int resolution) cons
 				double pixelStartY = (double)(y)   * scalingRatio;
 				double pixelEndY   = (double)(y+1) * scalingRatio;
 				
-				*canvas(startX + x, startY + y) = getScaledPixelDouble(pixelStartX, pixelEndX, pixelStartY, pixelEndY);
+				*canvas(startX + x, startY + y) = getScaledPixelDouble(image, pixelStartX, pixelEndX, pixelStartY, pixelEndY);
 			}
 		}
 	}
 }
 
-RGBAPixel TileImage::getScaledPixelDouble(double startX, double endX, double startY, double endY) const
+RGBAPixel TileImage::getScaledPixelDouble(const PNG & image, double startX, double endX, double startY, double endY)
 {
 	double leftFrac   = 1.0 - frac(startX);
 	double rightFrac  = frac(endX);
@@ -146,21 +241,22 @@ RGBAPixel TileImage::getScaledPixelDouble(double startX, double endX, double sta
 	return avg;
 }
 
-RGBAPixel TileImage::getScaledPixelInt(int startXint, int endXint, int startYint, int endYint) const
+RGBAPixel TileImage::getScaledPixelInt(const PNG & image, int startXint, int endXint, int startYint, int endYint)
 {
+	PNGView block = image.view(startXint, startYint, endXint - startXint, endYint - startYint);
 	uint64_t r = 0;
 	uint64_t g = 0;
 	uint64_t b = 0;
-	uint64_t totalPixels = 0;
+	uint64_t totalPixels = block.width() * block.height();
 
-	for (int x = startXint; x < endXint; x++)
+	for (size_t y = 0; y < block.height(); y++)
 	{
-		for (int y = startYint; y < endYint; y++)
+		const RGBAPixel * row = block.row(y);
+		for (size_t x = 0; x < block.width(); x++)
 		{
-			r += image(x, y)->red;
-			g += image(x, y)->green;
-			b += image(x, y)->blue;
-			totalPixels++;
+			r += row[x].red;
+			g += row[x].green;
+			b += row[x].blue;
 		}
 	}
 
@@ -8,29 +8,63 @@
 
 #include <math.h>
 #include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include "png.h"
 
 /**
  * Represents a Tile in the Photomosaic.
+ *
+ * Copies of a TileImage share the same (immutable) pixels. A tile can also
+ * be created from a file name and its already known average color and
+ * resolution, in which case the file is only read the first time its
+ * pixels are needed.
+ *
+ * A tile can instead keep only a pyramid of box-filtered thumbnails, from
+ * a given maximum resolution down to 1x1 in powers of two, and draw from
+ * the smallest of them that is at least as large as it is drawn. This
+ * keeps only a little more than the largest thumbnail in memory.
  */
 class TileImage
 {
 	private:
-	PNG image;
+	/**
+	 * The cropped pixels of a tile, which are decoded from fileName on
+	 * first use if it is not empty.
+	 */
+	struct Pixels
+	{
+		std::string fileName;
+		int thumbnailResolution; // 0 to keep the full image
+		std::once_flag loaded;
+		PNG image;
+		std::vector<PNG> thumbnails; // largest first
+	};
+
+	std::shared_ptr<Pixels> pixels;
 	RGBAPixel averageColor;
+	int imageResolution;
 
 	public:
 	TileImage();
-	explicit TileImage(const PNG & theImage);
+	explicit TileImage(PNG theImage, int thumbnailResolution = 0);
+	TileImage(const std::string & fileName, RGBAPixel theAverageColor, int theResolution,
+			int thumbnailResolution = 0);
 	RGBAPixel getAverageColor() const { return averageColor; }
-	int getResolution() const { return image.width(); }
+	int getResolution() const { return imageResolution; }
 	void paste(PNG & canvas, int startX, int startY, int resolution) const;
 	
 	private:
-	static PNG cropSourceImage(const PNG & source);
+	const PNG & getImage() const;
+	const PNG & getSourceFor(int resolution) const;
+	static PNG cropSourceImage(PNG source);
+	static void makeThumbnails(Pixels & pixels);
 	RGBAPixel calculateAverageColor() const;
-	RGBAPixel getScaledPixelDouble(double startX, double endX, double startY, double endY) const;
-	RGBAPixel getScaledPixelInt(int startX, int endX, int startY, int endY) const;
+	static void scale(const PNG & image, PNG & canvas, int startX, int startY, int resolution);
+	static RGBAPixel getScaledPixelDouble(const PNG & image, double startX, double endX, double startY, double endY);
+	static RGBAPixel getScaledPixelInt(const PNG & image, int startX, int endX, int startY, int endY);
 	static uint64_t divide(uint64_t a, uint64_t b) { return (a + b/2) / b; }
 	static int divide(int a, int b) { return divide(static_cast<uint64_t>(a), static_cast<uint64_t>(b)); }
 	static int fdivide(double a, double b) { return a / b + 0.5; }
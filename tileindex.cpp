@@ -0,0 +1,97 @@
+/**
+ * @file tileindex.cpp
+ * Implementation of the TileIndex class.
+ *
+ * The index is a text file with a version line followed by one line per
+ * file:
+ *
+ *     <size> <mtime> <resolution> <red> <green> <blue> <file name>
+ *
+ * The file name runs to the end of the line, so it may contain spaces.
+ */
+
+#include <sys/stat.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "tileindex.h"
+#include "util.h"
+
+using namespace std;
+
+static const string indexHeader = "mosaic-o-matic tile index 1";
+
+bool TileIndex::readFromFile(const string & indexFile)
+{
+	entries.clear();
+
+	ifstream in(indexFile.c_str());
+	string line;
+	if (!in || !getline(in, line) || line != indexHeader)
+		return false;
+
+	while (getline(in, line))
+	{
+		istringstream fields(line);
+		Entry entry;
+		int red, green, blue;
+		string fileName;
+		if (!(fields >> entry.fileSize >> entry.modifiedTime >> entry.resolution >> red >> green >> blue))
+			continue;
+		// A line that could not have been written is damaged, so the tile
+		// is read again instead
+		if (entry.resolution <= 0 || red < 0 || red > 255 || green < 0 || green > 255 || blue < 0 || blue > 255)
+			continue;
+		fields.get(); // the space before the file name
+		if (!getline(fields, fileName) || fileName.empty())
+			continue;
+
+		entry.averageColor = RGBAPixel(red, green, blue);
+		entries[fileName] = entry;
+	}
+	return true;
+}
+
+bool TileIndex::writeToFile(const string & indexFile) const
+{
+	return util::writeFileAtomically(indexFile, [this](ostream & out)
+	{
+		out << indexHeader << '\n';
+		for (map<string, Entry>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+		{
+			// A newline in a file name would end its line early
+			if (it->first.find('\n') != string::npos)
+				continue;
+
+			const Entry & entry = it->second;
+			out << entry.fileSize << ' ' << entry.modifiedTime << ' ' << entry.resolution << ' '
+				<< (int) entry.averageColor.red << ' ' << (int) entry.averageColor.green << ' '
+				<< (int) entry.averageColor.blue << ' ' << it->first << '\n';
+		}
+	});
+}
+
+bool TileIndex::lookup(const string & fileName, uint64_t fileSize, int64_t modifiedTime, Entry & entry) const
+{
+	map<string, Entry>::const_iterator it = entries.find(fileName);
+	if (it == entries.end() || it->second.fileSize != fileSize || it->second.modifiedTime != modifiedTime)
+		return false;
+	entry = it->second;
+	return true;
+}
+
+void TileIndex::update(const string & fileName, const Entry & entry)
+{
+	entries[fileName] = entry;
+}
+
+bool TileIndex::statFile(const string & fileName, uint64_t & fileSize, int64_t & modifiedTime)
+{
+	struct stat st;
+	if (stat(fileName.c_str(), &st) != 0)
+		return false;
+	fileSize = st.st_size;
+	modifiedTime = st.st_mtime;
+	return true;
+}
@@ -0,0 +1,90 @@
+/**
+ * @file tileindex.h
+ * Definition of the TileIndex class.
+ */
+
+#ifndef TILEINDEX_H
+#define TILEINDEX_H
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include "rgbapixel.h"
+
+using std::map;
+using std::string;
+
+/**
+ * An on-disk index of tile image files. For each file it records the size
+ * and modification time the file had when it was indexed, along with the
+ * resolution and average color of the tile made from it. As long as a file
+ * still has the same size and modification time, its tile can be matched
+ * against without decoding the file again.
+ */
+class TileIndex
+{
+	public:
+	/**
+	 * What is known about one indexed file.
+	 */
+	struct Entry
+	{
+		uint64_t fileSize;
+		int64_t modifiedTime;
+		int resolution;
+		RGBAPixel averageColor;
+	};
+
+	/**
+	 * Reads an index from disk, replacing any current entries. A missing
+	 * or unreadable index simply leaves the index empty.
+	 * @param indexFile Name of the index file.
+	 * @return Whether the index was read.
+	 */
+	bool readFromFile(const string & indexFile);
+
+	/**
+	 * Writes the index to disk with util::writeFileAtomically().
+	 * @param indexFile Name of the index file.
+	 * @return Whether the index was written.
+	 */
+	bool writeToFile(const string & indexFile) const;
+
+	/**
+	 * Looks up the entry for a file, if its size and modification time
+	 * still match the ones that were indexed.
+	 * @param fileName Name of the tile image file.
+	 * @param fileSize Current size of the file.
+	 * @param modifiedTime Current modification time of the file.
+	 * @param entry Set to the indexed entry if there is one.
+	 * @return Whether an up to date entry was found.
+	 */
+	bool lookup(const string & fileName, uint64_t fileSize, int64_t modifiedTime, Entry & entry) const;
+
+	/**
+	 * Adds or replaces the entry for a file.
+	 * @param fileName Name of the tile image file.
+	 * @param entry The entry for the file.
+	 */
+	void update(const string & fileName, const Entry & entry);
+
+	/**
+	 * Gets the number of indexed files.
+	 * @return The number of entries in the index.
+	 */
+	size_t size() const { return entries.size(); }
+
+	/**
+	 * Gets the current size and modification time of a file.
+	 * @param fileName Name of the file.
+	 * @param fileSize Set to the size of the file.
+	 * @param modifiedTime Set to the modification time of the file.
+	 * @return Whether the file could be stat-ed.
+	 */
+	static bool statFile(const string & fileName, uint64_t & fileSize, int64_t & modifiedTime);
+
+	private:
+	map<string, Entry> entries;
+};
+
+#endif // TILEINDEX_H
@@ -0,0 +1,244 @@
+/**
+ * @file tilelibrary.cpp
+ * Implementation of the TileLibrary class.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <climits>
+#include <cstring>
+#include <map>
+
+#include "tileindex.h"
+#include "tilelibrary.h"
+#include "util.h"
+
+using namespace std;
+
+namespace
+{
+
+const char libraryMagic[8] = { 'M', 'O', 'S', 'A', 'I', 'C', 'L', 'B' };
+const uint32_t libraryVersion = 1;
+const uint64_t pageSize = 4096;
+
+/**
+ * The largest tile resolution a library file may have, so the size of
+ * its tiles always fits in an int and in the file's offsets.
+ */
+const uint32_t maxTileResolution = 1 << 15;
+
+/**
+ * The start of a library file.
+ */
+struct Header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t tileResolution;
+	uint64_t fingerprint;
+	uint64_t numTiles;
+	uint64_t numNodes;
+	uint64_t colorsOffset;
+	uint64_t nodesOffset;
+	uint64_t atlasOffset;
+	uint64_t fileSize;
+};
+
+/**
+ * One entry of the color table or of the node array.
+ */
+struct ColorEntry
+{
+	uint8_t red;
+	uint8_t green;
+	uint8_t blue;
+	uint8_t pad;
+	uint32_t value; // resolution in the color table, tile index in the node array
+};
+
+/**
+ * Where each part of a library file goes.
+ */
+Header layout(size_t numTiles, size_t numNodes, int tileResolution)
+{
+	Header header;
+	memcpy(header.magic, libraryMagic, sizeof(libraryMagic));
+	header.version = libraryVersion;
+	header.tileResolution = tileResolution;
+	header.fingerprint = 0;
+	header.numTiles = numTiles;
+	header.numNodes = numNodes;
+	header.colorsOffset = sizeof(Header);
+	header.nodesOffset = header.colorsOffset + numTiles * sizeof(ColorEntry);
+	header.atlasOffset = (header.nodesOffset + numNodes * sizeof(ColorEntry) + pageSize - 1) / pageSize * pageSize;
+	header.fileSize = header.atlasOffset + numTiles * tileResolution * tileResolution * sizeof(RGBAPixel);
+	return header;
+}
+
+}
+
+TileLibrary::TileLibrary()
+	: libraryFingerprint(0), tiles(make_shared<const vector<TileImage> >()),
+	  tileColors(vector< Point<3> >()), atlas(make_shared<const TileAtlas>())
+{ /* nothing */ }
+
+TileLibrary::TileLibrary(const vector<TileImage> & theTiles, int tileResolution, uint64_t theFingerprint, int numThreads)
+	: libraryFingerprint(theFingerprint), tileColors(vector< Point<3> >())
+{
+	// Keep just the colors and resolutions of the tiles, as a read library
+	// would have them
+	vector<TileImage> colorsOnly;
+	map< Point<3>, size_t> tileIndices;
+	vector< Point<3> > colors;
+	for (size_t i = 0; i < theTiles.size(); i++)
+	{
+		RGBAPixel color = theTiles[i].getAverageColor();
+		colorsOnly.push_back(TileImage(string(), color, theTiles[i].getResolution()));
+		colors.push_back(Point<3>(color.red, color.green, color.blue));
+		tileIndices[colors.back()] = i;
+	}
+
+	tiles = make_shared<const vector<TileImage> >(move(colorsOnly));
+	tileColors = KDTree<3>(colors, true, numThreads);
+	const vector< Point<3> > & nodes = tileColors.getNodes();
+	nodeTiles.resize(nodes.size());
+	for (size_t i = 0; i < nodes.size(); i++)
+		nodeTiles[i] = tileIndices[nodes[i]];
+	atlas = make_shared<const TileAtlas>(TileAtlas::fromTiles(theTiles, tileResolution, numThreads));
+}
+
+bool TileLibrary::readFromFile(const string & fileName, uint64_t expectedFingerprint)
+{
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < sizeof(Header))
+	{
+		close(fd);
+		return false;
+	}
+
+	// The mapping stays valid after the file is closed. Pages are only read
+	// from the file when they are first touched
+	size_t length = st.st_size;
+	void * mapped = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED)
+		return false;
+	shared_ptr<const void> owner(mapped, [length](const void * p) { munmap(const_cast<void *>(p), length); });
+
+	const char * bytes = static_cast<const char *>(mapped);
+	Header header;
+	memcpy(&header, bytes, sizeof(Header));
+	if (memcmp(header.magic, libraryMagic, sizeof(libraryMagic)) != 0 || header.version != libraryVersion
+			|| header.fingerprint != expectedFingerprint)
+		return false;
+
+	// Each part of a file is no larger than the file, so once the counts
+	// are checked against it the layout can be worked out without overflow
+	uint64_t tileBytes = static_cast<uint64_t>(header.tileResolution) * header.tileResolution * sizeof(RGBAPixel);
+	if (header.tileResolution == 0 || header.tileResolution > maxTileResolution
+			|| header.numTiles > length / sizeof(ColorEntry) || header.numNodes > length / sizeof(ColorEntry)
+			|| header.numTiles > length / tileBytes)
+		return false;
+
+	Header expected = layout(header.numTiles, header.numNodes, header.tileResolution);
+	if (header.colorsOffset != expected.colorsOffset || header.nodesOffset != expected.nodesOffset
+			|| header.atlasOffset != expected.atlasOffset || header.fileSize != expected.fileSize
+			|| header.fileSize != length)
+		return false;
+
+	const ColorEntry * colorTable = reinterpret_cast<const ColorEntry *>(bytes + header.colorsOffset);
+	vector<TileImage> newTiles;
+	newTiles.reserve(header.numTiles);
+	for (size_t i = 0; i < header.numTiles; i++)
+	{
+		const ColorEntry & entry = colorTable[i];
+		if (entry.value > INT_MAX)
+			return false;
+		newTiles.push_back(TileImage(string(), RGBAPixel(entry.red, entry.green, entry.blue), entry.value));
+	}
+
+	const ColorEntry * nodeArray = reinterpret_cast<const ColorEntry *>(bytes + header.nodesOffset);
+	vector< Point<3> > nodes(header.numNodes);
+	vector<size_t> newNodeTiles(header.numNodes);
+	for (size_t i = 0; i < header.numNodes; i++)
+	{
+		const ColorEntry & entry = nodeArray[i];
+		if (entry.value >= header.numTiles)
+			return false;
+		nodes[i] = Point<3>(entry.red, entry.green, entry.blue);
+		newNodeTiles[i] = entry.value;
+	}
+
+	libraryFingerprint = header.fingerprint;
+	tiles = make_shared<const vector<TileImage> >(move(newTiles));
+	tileColors = KDTree<3>::fromNodes(nodes);
+	nodeTiles.swap(newNodeTiles);
+	atlas = make_shared<const TileAtlas>(header.numTiles, header.tileResolution,
+			reinterpret_cast<const RGBAPixel *>(bytes + header.atlasOffset), owner);
+	return true;
+}
+
+bool TileLibrary::writeToFile(const string & fileName) const
+{
+	const vector< Point<3> > & nodes = tileColors.getNodes();
+	Header header = layout(tiles->size(), nodes.size(), atlas->getTileResolution());
+	header.fingerprint = libraryFingerprint;
+
+	vector<ColorEntry> colorTable(tiles->size());
+	for (size_t i = 0; i < tiles->size(); i++)
+	{
+		RGBAPixel color = (*tiles)[i].getAverageColor();
+		ColorEntry entry = { color.red, color.green, color.blue, 0, static_cast<uint32_t>((*tiles)[i].getResolution()) };
+		colorTable[i] = entry;
+	}
+
+	vector<ColorEntry> nodeArray(nodes.size());
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		ColorEntry entry = { static_cast<uint8_t>(nodes[i][0]), static_cast<uint8_t>(nodes[i][1]),
+			static_cast<uint8_t>(nodes[i][2]), 0, static_cast<uint32_t>(nodeTiles[i]) };
+		nodeArray[i] = entry;
+	}
+
+	return util::writeFileAtomically(fileName, [&](ostream & out)
+	{
+		uint64_t nodesEnd = header.nodesOffset + nodeArray.size() * sizeof(ColorEntry);
+		vector<char> padding(header.atlasOffset - nodesEnd, 0);
+		out.write(reinterpret_cast<const char *>(&header), sizeof(Header));
+		out.write(reinterpret_cast<const char *>(colorTable.data()), colorTable.size() * sizeof(ColorEntry));
+		out.write(reinterpret_cast<const char *>(nodeArray.data()), nodeArray.size() * sizeof(ColorEntry));
+		out.write(padding.data(), padding.size());
+		out.write(reinterpret_cast<const char *>(atlas->data()), atlas->dataSize());
+	});
+}
+
+uint64_t TileLibrary::fingerprint(const vector<string> & files, int tileResolution)
+{
+	// FNV-1a over each file's name, size and modification time
+	uint64_t hash = 14695981039346656037ULL;
+	auto add = [&hash](const void * data, size_t length)
+	{
+		const unsigned char * bytes = static_cast<const unsigned char *>(data);
+		for (size_t i = 0; i < length; i++)
+			hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	};
+
+	add(&tileResolution, sizeof(tileResolution));
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		uint64_t fileSize = 0;
+		int64_t modifiedTime = 0;
+		TileIndex::statFile(files[i], fileSize, modifiedTime);
+		add(files[i].c_str(), files[i].size() + 1);
+		add(&fileSize, sizeof(fileSize));
+		add(&modifiedTime, sizeof(modifiedTime));
+	}
+	return hash;
+}
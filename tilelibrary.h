@@ -0,0 +1,120 @@
+/**
+ * @file tilelibrary.h
+ * Definition of the TileLibrary class.
+ */
+
+#ifndef TILELIBRARY_H
+#define TILELIBRARY_H
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "kdtree.h"
+#include "tileatlas.h"
+#include "tileimage.h"
+
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+/**
+ * Everything needed to make mosaics from a set of tiles at one resolution,
+ * without decoding any of them: the tiles' average colors, a KDTree of
+ * those colors, and an atlas of the tiles scaled to that resolution.
+ *
+ * A library can be saved to a binary file and mapped back into memory,
+ * so that the file's pages are only read in as they are used: the atlas
+ * pages of tiles that are never drawn are never read at all. The file
+ * holds, in the byte order of the machine that wrote it:
+ *
+ *  - a header (see tilelibrary.cpp) giving the counts and offsets below;
+ *  - the color table: per tile, its average red, green and blue, a pad
+ *    byte and its original resolution as a uint32;
+ *  - the KDTree node array, in KDTree::getNodes() order: per node, its
+ *    red, green and blue, a pad byte and its tile's index as a uint32;
+ *  - the atlas, starting on a page boundary.
+ */
+class TileLibrary
+{
+	public:
+	/**
+	 * Creates an empty library.
+	 */
+	TileLibrary();
+
+	/**
+	 * Builds a library from decoded tiles.
+	 * @param theTiles The tiles.
+	 * @param tileResolution Resolution to scale the tiles to in the atlas.
+	 * @param theFingerprint Identifies the tile files the library was
+	 *  built from; see fingerprint().
+	 * @param numThreads Number of threads to scale tiles on.
+	 */
+	TileLibrary(const vector<TileImage> & theTiles, int tileResolution, uint64_t theFingerprint, int numThreads = 1);
+
+	/**
+	 * Maps a library file into memory, replacing this library. Fails if
+	 * the file is missing, malformed, or was built from different files.
+	 * @param fileName Name of the library file.
+	 * @param expectedFingerprint The fingerprint the library must have.
+	 * @return Whether the library was read.
+	 */
+	bool readFromFile(const string & fileName, uint64_t expectedFingerprint);
+
+	/**
+	 * Writes the library to a file with util::writeFileAtomically().
+	 * @param fileName Name of the library file.
+	 * @return Whether the library was written.
+	 */
+	bool writeToFile(const string & fileName) const;
+
+	/**
+	 * Computes a fingerprint of a set of tile files and a resolution from
+	 * the files' names, sizes and modification times, without reading
+	 * them.
+	 * @param files Names of the tile image files.
+	 * @param tileResolution The resolution tiles are drawn at.
+	 * @return The fingerprint.
+	 */
+	static uint64_t fingerprint(const vector<string> & files, int tileResolution);
+
+	/**
+	 * Gets the fingerprint of the tile files the library was built from.
+	 * @return The fingerprint.
+	 */
+	uint64_t getFingerprint() const { return libraryFingerprint; }
+
+	/**
+	 * Gets the tiles. Their pixels are only available through the atlas.
+	 * @return The tiles, in atlas order.
+	 */
+	shared_ptr<const vector<TileImage> > getTiles() const { return tiles; }
+
+	/**
+	 * Gets the KDTree of the tiles' average colors.
+	 * @return The tree.
+	 */
+	const KDTree<3> & getTileColors() const { return tileColors; }
+
+	/**
+	 * Gets the index of the tile each of the tree's nodes stands for.
+	 * @return The tile of each node, in KDTree::getNodes() order.
+	 */
+	const vector<size_t> & getNodeTiles() const { return nodeTiles; }
+
+	/**
+	 * Gets the atlas of the tiles.
+	 * @return The atlas.
+	 */
+	shared_ptr<const TileAtlas> getAtlas() const { return atlas; }
+
+	private:
+	uint64_t libraryFingerprint;
+	shared_ptr<const vector<TileImage> > tiles;
+	KDTree<3> tileColors;
+	vector<size_t> nodeTiles;
+	shared_ptr<const TileAtlas> atlas;
+};
+
+#endif // TILELIBRARY_H
@@ -0,0 +1,134 @@
+/**
+ * @file tilelookuptable.cpp
+ * Implementation of the TileLookupTable class.
+ *
+ * A saved table is a header followed by each allocated block, as its
+ * index (red * 256 + green) and then its 256 entries, indexed by blue.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#include "tilelookuptable.h"
+#include "util.h"
+
+using namespace std;
+
+namespace
+{
+
+const char tableMagic[8] = { 'M', 'O', 'S', 'A', 'I', 'C', 'L', 'T' };
+const uint32_t tableVersion = 1;
+
+/**
+ * The start of a table file.
+ */
+struct Header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t numBlocks;
+	uint64_t fingerprint;
+	uint64_t numTiles; // one more than the largest entry
+};
+
+}
+
+const uint32_t TileLookupTable::unknown;
+const size_t TileLookupTable::blockSize;
+const size_t TileLookupTable::numBlocks;
+
+TileLookupTable::TileLookupTable()
+	: blocks(numBlocks), numEntries(0)
+{ /* nothing */ }
+
+void TileLookupTable::insert(RGBAPixel color, uint32_t tile)
+{
+	unique_ptr<uint32_t[]> & block = blocks[blockIndex(color)];
+	if (!block)
+	{
+		block.reset(new uint32_t[blockSize]);
+		fill(block.get(), block.get() + blockSize, unknown);
+	}
+	if (block[color.blue] == unknown)
+		numEntries++;
+	block[color.blue] = tile;
+}
+
+void TileLookupTable::clear()
+{
+	for (size_t i = 0; i < numBlocks; i++)
+		blocks[i].reset();
+	numEntries = 0;
+}
+
+bool TileLookupTable::readFromFile(const string & fileName, uint64_t fingerprint, size_t numTiles)
+{
+	clear();
+
+	ifstream in(fileName.c_str(), ios::binary);
+	Header header;
+	if (!in || !in.read(reinterpret_cast<char *>(&header), sizeof(Header))
+			|| memcmp(header.magic, tableMagic, sizeof(tableMagic)) != 0 || header.version != tableVersion
+			|| header.fingerprint != fingerprint || header.numTiles > numTiles || header.numBlocks > numBlocks)
+		return false;
+
+	for (uint32_t b = 0; b < header.numBlocks; b++)
+	{
+		uint32_t index;
+		unique_ptr<uint32_t[]> block(new uint32_t[blockSize]);
+		if (!in.read(reinterpret_cast<char *>(&index), sizeof(index))
+				|| !in.read(reinterpret_cast<char *>(block.get()), blockSize * sizeof(uint32_t))
+				|| index >= numBlocks || blocks[index])
+		{
+			clear();
+			return false;
+		}
+
+		for (size_t i = 0; i < blockSize; i++)
+		{
+			if (block[i] == unknown)
+				continue;
+			if (block[i] >= numTiles)
+			{
+				clear();
+				return false;
+			}
+			numEntries++;
+		}
+		blocks[index] = move(block);
+	}
+	return true;
+}
+
+bool TileLookupTable::writeToFile(const string & fileName, uint64_t fingerprint) const
+{
+	Header header;
+	memcpy(header.magic, tableMagic, sizeof(tableMagic));
+	header.version = tableVersion;
+	header.numBlocks = 0;
+	header.fingerprint = fingerprint;
+	header.numTiles = 0;
+	for (size_t i = 0; i < numBlocks; i++)
+	{
+		if (!blocks[i])
+			continue;
+		header.numBlocks++;
+		for (size_t j = 0; j < blockSize; j++)
+			if (blocks[i][j] != unknown)
+				header.numTiles = max<uint64_t>(header.numTiles, blocks[i][j] + 1);
+	}
+
+	return util::writeFileAtomically(fileName, [this, &header](ostream & out)
+	{
+		out.write(reinterpret_cast<const char *>(&header), sizeof(Header));
+		for (uint32_t i = 0; i < numBlocks; i++)
+		{
+			if (!blocks[i])
+				continue;
+			out.write(reinterpret_cast<const char *>(&i), sizeof(i));
+			out.write(reinterpret_cast<const char *>(blocks[i].get()), blockSize * sizeof(uint32_t));
+		}
+	});
+}
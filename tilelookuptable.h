@@ -0,0 +1,105 @@
+/**
+ * @file tilelookuptable.h
+ * Definition of the TileLookupTable class.
+ */
+
+#ifndef TILELOOKUPTABLE_H
+#define TILELOOKUPTABLE_H
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "rgbapixel.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+/**
+ * A memo of the tile chosen for each 8-bit RGB color, so that a region
+ * color that has been matched before costs one load instead of a KDTree
+ * search. The table covers all 2^24 colors, but is allocated lazily in
+ * blocks of 256 colors that share their red and green, so a table only
+ * takes memory for the parts of color space that have been looked up.
+ *
+ * The tiles are referred to by index, so a table is only valid for the
+ * set of tiles it was filled against. Saved tables are tagged with a
+ * fingerprint of those tiles (such as TileLibrary::getFingerprint()) so
+ * that a table is never reused with different tiles.
+ */
+class TileLookupTable
+{
+	public:
+	/**
+	 * The value of colors that have not been looked up.
+	 */
+	static const uint32_t unknown = UINT32_MAX;
+
+	/**
+	 * Creates an empty table.
+	 */
+	TileLookupTable();
+
+	/**
+	 * Gets the tile for a color.
+	 * @param color The color. Only its red, green and blue are used.
+	 * @return The index of the color's tile, or unknown.
+	 */
+	uint32_t lookup(RGBAPixel color) const
+	{
+		const uint32_t * block = blocks[blockIndex(color)].get();
+		return block == NULL ? unknown : block[color.blue];
+	}
+
+	/**
+	 * Sets the tile for a color.
+	 * @param color The color. Only its red, green and blue are used.
+	 * @param tile The index of the color's tile.
+	 */
+	void insert(RGBAPixel color, uint32_t tile);
+
+	/**
+	 * Gets the number of colors whose tile is known.
+	 * @return The number of entries.
+	 */
+	size_t size() const { return numEntries; }
+
+	/**
+	 * Forgets every entry.
+	 */
+	void clear();
+
+	/**
+	 * Reads a table from disk, replacing any current entries. A missing
+	 * or unreadable table, or one filled against other tiles, leaves the
+	 * table empty.
+	 * @param fileName Name of the table file.
+	 * @param fingerprint The fingerprint of the tiles the table must have
+	 *  been filled against.
+	 * @param numTiles The number of tiles; every entry must be less.
+	 * @return Whether the table was read.
+	 */
+	bool readFromFile(const string & fileName, uint64_t fingerprint, size_t numTiles);
+
+	/**
+	 * Writes the table to disk, in the byte order of this machine, with
+	 * util::writeFileAtomically().
+	 * @param fileName Name of the table file.
+	 * @param fingerprint The fingerprint of the tiles the table was filled
+	 *  against.
+	 * @return Whether the table was written.
+	 */
+	bool writeToFile(const string & fileName, uint64_t fingerprint) const;
+
+	private:
+	static const size_t blockSize = 256;
+	static const size_t numBlocks = 256 * 256;
+
+	static size_t blockIndex(RGBAPixel color) { return (color.red << 8) | color.green; }
+
+	vector< unique_ptr<uint32_t[]> > blocks;
+	size_t numEntries;
+};
+
+#endif // TILELOOKUPTABLE_H
@@ -596,6 +596,36 @@ string get_symlink_target(const string & symlink)
 	return string(buf);
 }
 
+bool writeFileAtomically(const string & fileName, const function<void(ostream &)> & writeContents)
+{
+	// mkstemp picks a name no other writer has, and creates the file
+	vector<char> tempFile(fileName.begin(), fileName.end());
+	const char suffix[] = ".XXXXXX";
+	tempFile.insert(tempFile.end(), suffix, suffix + sizeof(suffix));
+	int fd = mkstemp(tempFile.data());
+	if (fd < 0) return false;
+
+	// mkstemp makes the file private to us, but the files it replaces are
+	// caches anyone may read
+	bool written = fchmod(fd, 0644) == 0;
+	close(fd);
+
+	if (written)
+	{
+		ofstream out(tempFile.data(), ios::binary | ios::trunc);
+		writeContents(out);
+		out.close();
+		written = !out.fail();
+	}
+
+	if (!written || rename(tempFile.data(), fileName.c_str()) != 0)
+	{
+		remove(tempFile.data());
+		return false;
+	}
+	return true;
+}
+
 void linkDirs(const string & sourceFolder, const string & destFolder, const vector<string> & dirs)
 {
 	assertExists(destFolder);
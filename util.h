@@ -21,6 +21,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <sstream>
@@ -172,6 +173,16 @@ vector<string> get_files_in_dir(const string & dir, bool concatdir = true);
 bool is_symlink(const string & file);
 string get_symlink_target(const string & symlink);
 
+/**
+ * Writes a file by calling writeContents on a stream to a new temporary
+ * file in the same directory, and then renaming that over fileName. An
+ * interrupted write never leaves a partial file behind, and each write
+ * gets its own temporary file, so processes writing the same file at once
+ * don't clobber each other's; the last rename wins.
+ * @return Whether the file was written.
+ */
+bool writeFileAtomically(const string & fileName, const function<void(ostream &)> & writeContents);
+
 // STRING REPLACEMENT
 bool   replaceFirst(string & str, const string & toreplace, const string & with);
 size_t replaceAll  (string & str, const string & toreplace, const string & with);